@@ -1,11 +1,174 @@
 
+#ifndef _WIN32
+/* madvise() is not exposed in strict C89 mode otherwise */
+# define _DEFAULT_SOURCE
+# define _BSD_SOURCE
+#endif
+
 #include "pfs.h"
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h>
+#include <time.h>
 #include <zlib.h>
 
+#ifdef PFS_USE_LIBDEFLATE
+# include <libdeflate.h>
+#endif
+
+#if !defined(_WIN32) && !defined(PFS_NO_THREADS)
+# define PFS_HAVE_THREADS
+# include <pthread.h>
+#endif
+
+/* Only read-only handles are shared between threads; these keep their lazily filled in state safe to publish */
+#ifdef PFS_HAVE_THREADS
+# ifdef __ATOMIC_ACQUIRE
+#  define pfs_atomic_load(ptr) __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+# else
+#  define pfs_atomic_load(ptr) __sync_fetch_and_add((ptr), 0)
+# endif
+# define pfs_atomic_clear(ptr) __sync_lock_release((ptr))
+# define pfs_atomic_publish(ptr, unset, val) ((void)__sync_bool_compare_and_swap((ptr), (unset), (val)))
+#else
+# define pfs_atomic_load(ptr) (*(ptr))
+# define pfs_atomic_clear(ptr) (*(ptr) = 0)
+# define pfs_atomic_publish(ptr, unset, val) (*(ptr) = (val))
+#endif
+
+#ifndef _WIN32
+# include <sys/types.h>
+# include <sys/stat.h>
+# include <sys/mman.h>
+# include <fcntl.h>
+# include <unistd.h>
+# include <errno.h>
+#endif
+
+/*
+** Counters go to the handle and to a process-wide total with relaxed atomics: nothing orders against them, they only
+** need to add up. Lookups are too cheap to pay for that: they are counted per handle, atomically only on read-only
+** handles, and folded into the process total on close. Elsewhere concurrent readers may lose a count, never tear one.
+** Block and I/O counters may come from worker threads of any handle. PFS_NO_STATS compiles all of it out, trace
+** callback included.
+*/
+#ifndef PFS_NO_STATS
+# if defined(PFS_HAVE_THREADS) && defined(__ATOMIC_RELAXED)
+#  define pfs_stat_add_to(ptr, val) ((void)__atomic_fetch_add((ptr), (val), __ATOMIC_RELAXED))
+#  define pfs_stat_read(ptr) __atomic_load_n((ptr), __ATOMIC_RELAXED)
+#  define pfs_stat_write(ptr, val) __atomic_store_n((ptr), (val), __ATOMIC_RELAXED)
+# elif defined(PFS_HAVE_THREADS)
+#  define pfs_stat_add_to(ptr, val) ((void)__sync_fetch_and_add((ptr), (val)))
+#  define pfs_stat_read(ptr) __sync_fetch_and_add((ptr), 0)
+#  define pfs_stat_write(ptr, val) ((void)__sync_lock_test_and_set((ptr), (val)))
+# else
+#  define pfs_stat_add_to(ptr, val) ((void)(*(ptr) += (val)))
+#  define pfs_stat_read(ptr) (*(ptr))
+#  define pfs_stat_write(ptr, val) ((void)(*(ptr) = (val)))
+# endif
+# define pfs_stat_add_local(pfs, field, val) do { if ((pfs)->readOnly) pfs_stat_add_to(&(pfs)->stats.field, (uint64_t)(val)); else pfs_stat_write(&(pfs)->stats.field, pfs_stat_read(&(pfs)->stats.field) + (uint64_t)(val)); } while(0)
+# define pfs_stat_add(pfs, field, val) do { uint64_t v_ = (uint64_t)(val); pfs_stat_add_to(&pfs_global_stats.field, v_); if ((pfs)) pfs_stat_add_to(&(pfs)->stats.field, v_); } while(0)
+# define pfs_stat_begin() pfs_now_ns()
+# define pfs_stat_time(pfs, field, start) pfs_stat_add((pfs), field, pfs_now_ns() - (start))
+# define pfs_stat_alloc(pfs, bytes) do { pfs_stat_add((pfs), allocations, 1); pfs_stat_add((pfs), allocatedBytes, (bytes)); } while(0)
+# define pfs_trace_begin() ((pfs_trace_fn) ? pfs_now_ns() : 0)
+# define pfs_trace_elapsed(start) ((pfs_trace_fn) ? pfs_now_ns() - (start) : 0)
+# define pfs_trace_emit(op, name, bytes, ns, rc) do { if (pfs_trace_fn) pfs_trace_fn(pfs_trace_userdata, (op), (name), (bytes), (ns), (rc)); } while(0)
+# define pfs_trace_end(op, name, bytes, start, rc) pfs_trace_emit((op), (name), (bytes), pfs_trace_elapsed(start), (rc))
+
+static PfsStats pfs_global_stats;
+static PfsTraceFn pfs_trace_fn;
+static void* pfs_trace_userdata;
+
+static uint64_t pfs_now_ns(void)
+{
+# ifdef _WIN32
+    return (uint64_t)clock() * (1000000000 / CLOCKS_PER_SEC);
+# else
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+# endif
+}
+#else
+# define pfs_stat_add_local(pfs, field, val) ((void)(val))
+# define pfs_stat_add(pfs, field, val) ((void)(val))
+# define pfs_stat_begin() 0
+# define pfs_stat_time(pfs, field, start) ((void)(start))
+# define pfs_stat_alloc(pfs, bytes) ((void)(bytes))
+# define pfs_trace_begin() 0
+# define pfs_trace_elapsed(start) ((void)(start), 0)
+# define pfs_trace_emit(op, name, bytes, ns, rc) ((void)(ns))
+# define pfs_trace_end(op, name, bytes, start, rc) ((void)(start))
+#endif
+
+/* Everything goes through these, see pfs_set_allocator() */
+static void* pfs_default_malloc(void* userdata, size_t size)
+{
+    (void)userdata;
+    return malloc(size);
+}
+
+static void* pfs_default_realloc(void* userdata, void* ptr, size_t size)
+{
+    (void)userdata;
+    return realloc(ptr, size);
+}
+
+static void pfs_default_free(void* userdata, void* ptr)
+{
+    (void)userdata;
+    free(ptr);
+}
+
+static PfsMallocFn pfs_malloc_fn = pfs_default_malloc;
+static PfsReallocFn pfs_realloc_fn = pfs_default_realloc;
+static PfsFreeFn pfs_free_fn = pfs_default_free;
+static void* pfs_alloc_userdata;
+
+#define pfs_malloc(size) pfs_malloc_fn(pfs_alloc_userdata, (size))
+#define pfs_realloc(ptr, size) pfs_realloc_fn(pfs_alloc_userdata, (ptr), (size))
+#define pfs_free(ptr) pfs_free_fn(pfs_alloc_userdata, (ptr))
+
+static void* pfs_calloc(size_t count, size_t size)
+{
+    void* ptr;
+    
+    if (size && count > (size_t)-1 / size)
+        return NULL;
+    
+    ptr = pfs_malloc(count * size);
+    if (ptr) memset(ptr, 0, count * size);
+    return ptr;
+}
+
+static voidpf pfs_zalloc(voidpf opaque, uInt items, uInt size)
+{
+    (void)opaque;
+    return pfs_malloc((size_t)items * size);
+}
+
+static void pfs_zfree(voidpf opaque, voidpf ptr)
+{
+    (void)opaque;
+    pfs_free(ptr);
+}
+
+#ifdef PFS_USE_LIBDEFLATE
+static void* pfs_libdeflate_malloc(size_t size)
+{
+    return pfs_malloc(size);
+}
+
+static void pfs_libdeflate_free(void* ptr)
+{
+    pfs_free(ptr);
+}
+#endif
+
 typedef struct {
     uint32_t    offset;
     uint32_t    signature;
@@ -23,30 +186,181 @@ typedef struct {
     uint32_t    inflatedLen;
 } PfsFileEntry;
 
+/* A reference-counted inflated entry; the cache holds one reference, each pfs_file_data_shared() caller another */
+typedef struct PfsShared {
+    uint32_t            refs;
+    uint32_t            length;
+    uint32_t            index;  /* Entry this caches, while linked */
+    struct PfsShared*   prev;   /* More recently used */
+    struct PfsShared*   next;   /* Less recently used */
+} PfsShared;
+
+#define PFS_SHARED_HEADER_SIZE ((sizeof(PfsShared) + 15) & ~15)
+#define pfs_shared_data(sh) ((uint8_t*)(sh) + PFS_SHARED_HEADER_SIZE)
+#define pfs_shared_from_data(ptr) ((PfsShared*)((uint8_t*)(ptr) - PFS_SHARED_HEADER_SIZE))
+
+/*
+** What lookups and reads need, 32 bytes on 64-bit so two share a cache line. Offset and sizes stay in here rather
+** than in a packed array of their own: reads and enumeration want the name or the inserted data along with them.
+** The name's CRC doubles as its hash in the index, so a slot is just an entry index. With the 8 byte cold part and
+** 2 to 4 slots an entry costs 48 to 56 bytes, more than the 44 (a 40 byte entry and a 4 byte hash) of the original
+** linear scan: the slots buy constant-time lookups, the cold part incremental saves and per-entry levels.
+*/
 typedef struct {
     char*       name;
-    uint8_t     nameIsCopy;
-    uint8_t     insertedIsCopy;
+    uint8_t*    inserted;
     uint32_t    crc;
     uint32_t    offset;
     uint32_t    inflatedLen;
     uint32_t    deflatedLen;
-    uint8_t*    inserted;
 } PfsEntry;
 
+/* The rest, in a separate array parallel to the entries: ownership and write bookkeeping */
+typedef struct {
+    uint32_t    fileOffset;     /* Where the compressed data sits in the backing file, PFS_OFFSET_NONE if it isn't there */
+    uint8_t     insertedIsCopy;
+    int8_t      level;          /* Level this handle compressed it at, PFS_LEVEL_DEFAULT if it didn't */
+} PfsEntryCold;
+
+#define PFS_OFFSET_NONE 0xffffffff
+
+/* Names of appended entries are carved from these, and only freed all together by pfs_close() */
+typedef struct PfsArenaChunk {
+    struct PfsArenaChunk*   next;
+    uint32_t                used;
+    uint32_t                size;
+} PfsArenaChunk;
+
+#define PFS_ARENA_CHUNK_SIZE 16384
+#define pfs_arena_data(chunk) ((char*)(chunk) + sizeof(PfsArenaChunk))
+
+#define pfs_cold(pfs, ent) (&(pfs)->cold[(ent) - (pfs)->entries])
+
+/* Cached entries are few next to the archive, so they're found through a table of their own, not a pointer per entry */
+typedef struct {
+    PfsShared*  head;
+    PfsShared*  tail;
+    PfsShared** table;      /* Open-addressing, keyed by entry index */
+    uint32_t    tableSize;  /* Always zero or a power of 2 */
+    uint32_t    budget;
+    uint32_t    bytes;
+    uint32_t    count;
+    uint64_t    hits;
+    uint64_t    misses;
+    uint64_t    evictions;
+} PfsCache;
+
 typedef struct {
     uint8_t*    data;
-    uint32_t    length;
-} PfsBuf;
+    uint32_t    capacity;
+    uint32_t    length;     /* Keeps counting past capacity so the caller learns the size needed */
+} PfsMemorySink;
+
+/* Kept across blocks and calls so each block costs an inflateReset() rather than inflateInit()/inflateEnd() */
+struct PfsInflater {
+    z_stream    stream;
+    int         isInit;
+#ifdef PFS_USE_LIBDEFLATE
+    struct libdeflate_decompressor* decompressor;   /* Allocated on first use */
+#endif
+};
+
+/* Same idea for compression, where the state is far larger (around 256KB at the default memLevel) */
+typedef struct {
+    z_stream    stream;
+    int         isInit;
+    int         level;
+} PfsDeflater;
+
+/* Single zlib stream in, single zlib stream out; see pfs_set_codec() */
+typedef struct {
+    const char* name;
+    int         (*inflateBlock)(PfsInflater* inf, uint8_t* dst, uint32_t dstLen, const uint8_t* src, uint32_t srcLen, uint32_t* outLen);
+    int         (*deflateBlock)(PfsDeflater* def, int level, uint8_t* dst, uint32_t dstLen, const uint8_t* src, uint32_t srcLen, uint32_t* outLen);
+} PfsCodec;
+
+#define PFS_EXT_MAX 16
+#define PFS_INFLATER_POOL 8
+
+typedef struct {
+    char        ext[PFS_EXT_MAX];   /* Without the dot */
+    int         level;
+} PfsExtLevel;
 
 struct PFS {
     uint32_t    count;
     uint32_t    length;
     PfsEntry*   entries;
-    uint32_t*   hashes;
+    PfsEntryCold* cold;     /* Per entry, same capacity as entries */
+    uint32_t*   slots;      /* Open-addressing index of entry index + 1 by name CRC, 0 = empty */
+    uint32_t    slotCount;  /* Always zero or a power of 2 */
     uint8_t*    data;
     uint8_t*    nameData;
-    int         dataIsCopy;
+    PfsArenaChunk* arena;       /* Names of appended entries */
+    uint32_t    dirOffset;      /* Position of the on-disk PfsFileEntry table */
+    uint32_t    dirCount;       /* Includes the name data entry */
+    int         namesPending;   /* Opened with PFS_OPEN_DIRECTORY_ONLY and names not yet inflated */
+    int         unsaved;        /* Entries were added, replaced or removed since the last write to disk */
+    int         dataOwner;
+    int         readOnly;       /* PFS_OPEN_READ_ONLY: no mutation, reads safe from any thread */
+    int         level;
+    uint32_t    blockSize;
+    PfsExtLevel* extLevels;     /* Per extension overrides of level, see pfs_set_extension_level() */
+    uint32_t    extLevelCount;
+    PfsInflater inflater;
+    PfsDeflater deflater;
+    PfsCache    cache;
+#ifdef PFS_HAVE_THREADS
+    /* Readers take a free pooled inflater; the one above is left to the name load */
+    PfsInflater pool[PFS_INFLATER_POOL];
+    int         poolBusy[PFS_INFLATER_POOL];
+    pthread_mutex_t lock;       /* Read-only handles only: serializes the cache and the one-time name load */
+#endif
+    /* The archive on disk as of the last open or save, for pfs_save_incremental() */
+    uint32_t    fileLength;     /* 0 if there is none */
+    uint32_t    fileDirOffset;
+    uint32_t    fileDirSize;
+    uint32_t    fileDirCrc;
+    uint32_t    fileNamesLen;
+    uint32_t    dedupSaved;     /* Compressed bytes the last write didn't store thanks to identical entries */
+#ifndef PFS_NO_STATS
+    PfsStats    stats;
+#endif
+};
+
+/* Where pfs_write_impl() puts everything */
+typedef struct {
+    uint32_t*       offsets;        /* Per entry, in entry order */
+    PfsFileEntry*   fileEntries;    /* Directory, including the name entry, sorted by CRC */
+    PfsEntry        names;          /* Compressed name data entry */
+    uint32_t        start;          /* Where new data begins */
+    uint32_t        dirOffset;
+    uint32_t        end;
+} PfsLayout;
+
+typedef struct {
+    uint32_t    srcPos;     /* Start of the compressed data, past the PfsBlock header */
+    uint32_t    deflatedLen;
+    uint32_t    dstPos;
+    uint32_t    inflatedLen;
+} PfsBlockRef;
+
+struct PfsStream {
+    PFS*            pfs;
+    const uint8_t*  src;
+    PfsBlockRef*    blocks;
+    uint32_t        blockCount;
+    uint32_t        size;
+    uint32_t        pos;
+    uint8_t*        buffer;     /* Holds one inflated block, sized for the largest */
+    uint32_t        buffered;   /* Index of the block in buffer, or blockCount if none */
+    PfsInflater     inflater;
+};
+
+enum PfsDataOwner {
+    PFS_DATA_BORROWED,
+    PFS_DATA_MALLOC,
+    PFS_DATA_MMAP
 };
 
 static uint32_t pfs_crc_table[] = {
@@ -86,7 +400,52 @@ static uint32_t pfs_crc_table[] = {
 
 #define pfs_is_pow2(n) ((n) && (((n) & ((n) - 1)) == 0))
 #define pfs_is_pow2_or_zero(n) ((n == 0) || (((n) & ((n) - 1)) == 0))
-#define pfs_free_if_exists(ptr) do { if ((ptr)) free((ptr)); } while(0)
+#define pfs_free_if_exists(ptr) do { if ((ptr)) pfs_free((ptr)); } while(0)
+
+/* Requests over a quarter chunk get a chunk of their own, linked behind the one still being filled */
+static char* pfs_arena_alloc(PFS* pfs, uint32_t size)
+{
+    PfsArenaChunk* chunk = pfs->arena;
+    char* ptr;
+    
+    if (!chunk || chunk->size - chunk->used < size)
+    {
+        uint32_t cap = (size > PFS_ARENA_CHUNK_SIZE / 4) ? size : PFS_ARENA_CHUNK_SIZE;
+        
+        chunk = (PfsArenaChunk*)pfs_malloc(sizeof(PfsArenaChunk) + cap);
+        if (!chunk) return NULL;
+        
+        pfs_stat_alloc(pfs, sizeof(PfsArenaChunk) + cap);
+        chunk->used = 0;
+        chunk->size = cap;
+        
+        if (pfs->arena && cap != PFS_ARENA_CHUNK_SIZE)
+        {
+            chunk->next = pfs->arena->next;
+            pfs->arena->next = chunk;
+        }
+        else
+        {
+            chunk->next = pfs->arena;
+            pfs->arena = chunk;
+        }
+    }
+    
+    ptr = pfs_arena_data(chunk) + chunk->used;
+    chunk->used += size;
+    return ptr;
+}
+
+static void pfs_arena_free(PFS* pfs)
+{
+    while (pfs->arena)
+    {
+        PfsArenaChunk* next = pfs->arena->next;
+        
+        pfs_free(pfs->arena);
+        pfs->arena = next;
+    }
+}
 
 static uint32_t pfs_next_pow2(uint32_t n)
 {
@@ -108,24 +467,24 @@ static uint32_t pfs_pow2_greater_or_equal(uint32_t n)
     return pfs_is_pow2(n) ? (n) : pfs_next_pow2(n);
 }
 
+/* FNV-1a over every byte of the key */
 static uint32_t pfs_hash(const char* key, uint32_t len)
 {
-    uint32_t h = len;
-    uint32_t step = (len >> 5) + 1;
+    uint32_t h = 2166136261U;
     uint32_t i;
     
-    for (i = len; i >= step; i -= step)
+    for (i = 0; i < len; i++)
     {
-        h = h ^ ((h << 5) + (h >> 2) + (key[i - 1]));
+        h ^= (uint8_t)key[i];
+        h *= 16777619U;
     }
     
     return h;
 }
 
-static uint32_t pfs_crc(const void* data, uint32_t len)
+static uint32_t pfs_crc_update(uint32_t val, const void* data, uint32_t len)
 {
     const uint8_t* ptr = (const uint8_t*)data;
-    uint32_t val = 0;
     uint32_t idx;
     uint32_t i;
     
@@ -138,802 +497,4459 @@ static uint32_t pfs_crc(const void* data, uint32_t len)
     return val;
 }
 
-static int pfs_decompress_index(PFS* pfs, uint8_t** outData, uint32_t* outLength, uint32_t index)
+#define pfs_crc(data, len) pfs_crc_update(0, (data), (len))
+
+#define PFS_INDEX_MIN_SLOTS 16
+
+static void pfs_index_insert(PFS* pfs, uint32_t index)
+{
+    uint32_t* slots = pfs->slots;
+    uint32_t mask = pfs->slotCount - 1;
+    uint32_t i = pfs->entries[index].crc & mask;
+    
+    while (slots[i] != 0)
+    {
+        i = (i + 1) & mask;
+    }
+    
+    slots[i] = index + 1;
+}
+
+/* Regrows the index to room for at least minCount entries at a load factor of 1/2 or lower, moving over its slots */
+static int pfs_index_rebuild(PFS* pfs, uint32_t minCount)
 {
-    PfsEntry* ent;
-    uint8_t* src;
-    uint8_t* dst;
-    uint32_t ilen;
-    uint32_t read = 0;
-    uint32_t pos = 0;
+    uint32_t cap = pfs_pow2_greater_or_equal(minCount * 2);
+    uint32_t* old = pfs->slots;
+    uint32_t oldCount = pfs->slotCount;
+    uint32_t* slots;
+    uint32_t i;
     
-    if (index >= pfs->count)
-        return PFS_OUT_OF_BOUNDS;
+    if (cap < PFS_INDEX_MIN_SLOTS)
+        cap = PFS_INDEX_MIN_SLOTS;
     
-    ent = &pfs->entries[index];
-    ilen = ent->inflatedLen;
-    src = (ent->inserted) ? ent->inserted : pfs->data + ent->offset;
-    dst = (uint8_t*)malloc(ilen);
+    slots = (uint32_t*)pfs_calloc(cap, sizeof(uint32_t));
+    if (!slots) return PFS_OUT_OF_MEMORY;
     
-    if (!dst) return PFS_OUT_OF_MEMORY;
+    pfs->slots = slots;
+    pfs->slotCount = cap;
     
-    while (read < ilen)
+    for (i = 0; i < oldCount; i++)
     {
-        PfsBlock* block = (PfsBlock*)(src + pos);
-        unsigned long len;
-        int rc;
+        if (old[i])
+            pfs_index_insert(pfs, old[i] - 1);
+    }
+    
+    pfs_free_if_exists(old);
+    return PFS_OK;
+}
+
+static void pfs_index_free(PFS* pfs)
+{
+    pfs_free_if_exists(pfs->slots);
+    pfs->slots = NULL;
+    pfs->slotCount = 0;
+}
+
+static uint32_t pfs_index_slot_of(PFS* pfs, uint32_t index)
+{
+    uint32_t* slots = pfs->slots;
+    uint32_t mask = pfs->slotCount - 1;
+    uint32_t i = pfs->entries[index].crc & mask;
+    
+    while (slots[i] != index + 1)
+    {
+        i = (i + 1) & mask;
+    }
+    
+    return i;
+}
+
+/* Backward-shift deletion, keeps probe sequences intact without tombstones */
+static void pfs_index_remove(PFS* pfs, uint32_t index)
+{
+    uint32_t* slots = pfs->slots;
+    uint32_t mask = pfs->slotCount - 1;
+    uint32_t i = pfs_index_slot_of(pfs, index);
+    uint32_t j = i;
+    
+    for (;;)
+    {
+        uint32_t home;
         
-        pos += sizeof(PfsBlock);
+        j = (j + 1) & mask;
         
-        len = ilen - read;
-        rc = uncompress(dst + read, &len, src + pos, block->deflatedLen);
+        if (slots[j] == 0)
+            break;
         
-        if (rc != Z_OK) goto fail;
+        home = pfs->entries[slots[j] - 1].crc & mask;
         
-        read += block->inflatedLen;
-        pos += block->deflatedLen;
+        /* Leave the entry where it is if its home slot lies cyclically within (i, j] */
+        if ((i < j) ? (home > i && home <= j) : (home > i || home <= j))
+            continue;
+        
+        slots[i] = slots[j];
+        i = j;
     }
     
-    *outData = dst;
-    *outLength = ilen;
-    return PFS_OK;
-    
-fail:
-    free(dst);
-    return PFS_COMPRESSION_ERROR;
+    slots[i] = 0;
 }
 
-static int pfs_sort_by_offset(const void* va, const void* vb)
+static void pfs_index_move(PFS* pfs, uint32_t from, uint32_t to)
 {
-    const PfsEntry* a = (const PfsEntry*)va;
-    const PfsEntry* b = (const PfsEntry*)vb;
-    
-    return (a->offset < b->offset) ? -1 : 1;
+    pfs->slots[pfs_index_slot_of(pfs, from)] = to + 1;
 }
 
-static int pfs_open_impl(PFS** outPfs, const uint8_t* data, uint32_t length, int isCopy)
+#define PFS_DEFLATED_LEN_UNKNOWN 0xffffffff
+
+/* Walks and bounds-checks the block chain of an on-disk entry to find its compressed length */
+static int pfs_block_chain_length(const uint8_t* data, uint32_t length, uint32_t offset, uint32_t inflatedLen, uint32_t* outLen)
 {
-    PFS* pfs;
-    uint32_t p, n, i;
-    PfsHeader* h;
-    uint8_t* nameData = NULL;
-    int rc = PFS_CORRUPTED;
-    int foundTraceDotDbg = 0;
+    uint32_t p = offset;
+    uint32_t ilen = 0;
     
-    pfs = (PFS*)malloc(sizeof(PFS));
-    
-    if (!pfs)
+    while (ilen < inflatedLen)
     {
-        rc = PFS_OUT_OF_MEMORY;
-        goto fail_alloc;
+        PfsBlock* block = (PfsBlock*)(data + p);
+        
+        p += sizeof(PfsBlock);
+        
+        if (p > length || p < offset) return PFS_CORRUPTED;
+        
+        p += block->deflatedLen;
+        
+        if (p > length || p < offset) return PFS_CORRUPTED;
+        
+        ilen += block->inflatedLen;
     }
     
-    pfs->count = 0;
-    pfs->length = length;
-    pfs->entries = NULL;
-    pfs->hashes = NULL;
-    pfs->data = (uint8_t*)data;
-    pfs->nameData = NULL;
-    pfs->dataIsCopy = isCopy;
-    
-    p = sizeof(PfsHeader);
+    *outLen = p - offset;
+    return PFS_OK;
+}
+
+/* Entries opened with PFS_OPEN_LAZY have their block chains validated on first use */
+static int pfs_entry_resolve(PFS* pfs, PfsEntry* ent)
+{
+    uint32_t len;
+    int rc;
     
-    if (p > length) goto fail;
+    if (pfs_atomic_load(&ent->deflatedLen) != PFS_DEFLATED_LEN_UNKNOWN)
+        return PFS_OK;
     
-    h = (PfsHeader*)data;
+    rc = pfs_block_chain_length(pfs->data, pfs->length, ent->offset, ent->inflatedLen, &len);
     
-    if (memcmp(&h->signature, "PFS ", sizeof(uint32_t)) != 0)
-        goto fail;
+    /* Readers of a read-only handle may race here; they all find the same length */
+    if (rc == PFS_OK)
+        pfs_atomic_publish(&ent->deflatedLen, PFS_DEFLATED_LEN_UNKNOWN, len);
     
-    p = h->offset;
-    i = p + sizeof(uint32_t);
+    return rc;
+}
+
+typedef void (*PfsJobFn)(void* arg, uint32_t worker, uint32_t item);
+
+typedef struct {
+    PfsJobFn    fn;
+    void*       arg;
+    uint32_t    count;
+    uint32_t    next;
+} PfsJob;
+
+typedef struct {
+    PfsJob*     job;
+    uint32_t    worker;
+} PfsWorker;
+
+static void* pfs_worker_run(void* varg)
+{
+    PfsWorker* w = (PfsWorker*)varg;
+    PfsJob* job = w->job;
     
-    if (i > length) goto fail;
+    for (;;)
+    {
+#ifdef PFS_HAVE_THREADS
+        uint32_t item = __sync_fetch_and_add(&job->next, 1);
+#else
+        uint32_t item = job->next++;
+#endif
+        
+        if (item >= job->count)
+            break;
+        
+        job->fn(job->arg, w->worker, item);
+    }
     
-    n = *(uint32_t*)(data + p);
-    p = i;
+    return NULL;
+}
+
+/* nthreads == 0 means one per online CPU; never more threads than items */
+static uint32_t pfs_thread_count(uint32_t nthreads, uint32_t count)
+{
+    if (nthreads == 0)
+    {
+#ifdef PFS_HAVE_THREADS
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = (cpus > 0) ? (uint32_t)cpus : 1;
+#else
+        nthreads = 1;
+#endif
+    }
     
-    /* Must have at least one file + the name data entry to have any real content */
-    if (n <= 1) goto done;
+    if (nthreads > count)
+        nthreads = count;
     
-    i = pfs_pow2_greater_or_equal(n);
+    return (nthreads) ? nthreads : 1;
+}
+
+/*
+** Calls fn once for every item in [0, count), spread over nthreads workers, the calling thread being worker 0.
+** Workers pull items from a shared counter, so uneven items balance themselves; falls back to a plain loop without threads.
+*/
+static void pfs_parallel_for(uint32_t nthreads, uint32_t count, PfsJobFn fn, void* arg)
+{
+    PfsJob job;
+    PfsWorker local;
+#ifdef PFS_HAVE_THREADS
+    pthread_t* threads = NULL;
+    PfsWorker* workers = NULL;
+    uint32_t started = 0;
+    uint32_t i;
+#endif
     
-    pfs->entries = (PfsEntry*)malloc(sizeof(PfsEntry) * i);
-    if (!pfs->entries) goto oom;
+    job.fn = fn;
+    job.arg = arg;
+    job.count = count;
+    job.next = 0;
     
-    pfs->hashes = (uint32_t*)malloc(sizeof(uint32_t) * i);
-    if (!pfs->hashes)
+#ifdef PFS_HAVE_THREADS
+    if (nthreads > 1)
     {
-    oom:
-        rc = PFS_OUT_OF_MEMORY;
-        goto fail;
+        threads = (pthread_t*)pfs_malloc(sizeof(pthread_t) * (nthreads - 1));
+        workers = (PfsWorker*)pfs_malloc(sizeof(PfsWorker) * (nthreads - 1));
     }
     
-    for (i = 0; i < n; i++)
+    /* If threads can't be had the remaining workers simply pick up more of the items */
+    if (threads && workers)
     {
-        PfsFileEntry* src = (PfsFileEntry*)(data + p);
-        PfsEntry ent;
-        uint32_t memPos, ilen, totalLen, offset;
-        
-        memPos = p + sizeof(PfsFileEntry);
-        
-        if (memPos > length) goto fail;
-        
-        offset = src->offset;
-        
-        ent.name = NULL;
-        ent.nameIsCopy = 0;
-        ent.insertedIsCopy = 0;
-        ent.crc = src->crc;
-        ent.offset = offset;
-        ent.inflatedLen = src->inflatedLen;
-        ent.deflatedLen = 0;
-        ent.inserted = NULL;
-        
-        p = offset;
-        ilen = 0;
-        totalLen = src->inflatedLen;
-        
-        while (ilen < totalLen)
+        for (i = 0; i < nthreads - 1; i++)
         {
-            PfsBlock* block = (PfsBlock*)(data + p);
-            
-            p += sizeof(PfsBlock);
-            
-            if (p > length) goto fail;
-            
-            p += block->deflatedLen;
+            workers[i].job = &job;
+            workers[i].worker = i + 1;
             
-            if (p > length) goto fail;
+            if (pthread_create(&threads[i], NULL, pfs_worker_run, &workers[i]) != 0)
+                break;
             
-            ilen += block->inflatedLen;
+            started++;
         }
-        
-        ent.deflatedLen = p - offset;
-        
-        p = memPos;
-        pfs->entries[i] = ent;
     }
+#else
+    (void)nthreads;
+#endif
     
-    qsort(pfs->entries, n, sizeof(PfsEntry), pfs_sort_by_offset);
+    local.job = &job;
+    local.worker = 0;
+    pfs_worker_run(&local);
     
-    /* decompress the name data entry */
-    pfs->count = n;
-    n--;
-    rc = pfs_decompress_index(pfs, &nameData, &length, n);
-    if (rc) goto fail;
+#ifdef PFS_HAVE_THREADS
+    for (i = 0; i < started; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
     
-    pfs->count = n;
-    pfs->nameData = nameData;
+    pfs_free_if_exists(threads);
+    pfs_free_if_exists(workers);
+#endif
+}
+
+static void pfs_inflater_init(PfsInflater* inf)
+{
+    inf->isInit = 0;
+#ifdef PFS_USE_LIBDEFLATE
+    inf->decompressor = NULL;
+#endif
+}
+
+static int pfs_zlib_inflate_block(PfsInflater* inf, uint8_t* dst, uint32_t dstLen, const uint8_t* src, uint32_t srcLen, uint32_t* outLen)
+{
+    z_stream* zs = &inf->stream;
+    int rc;
     
-    if (length < sizeof(uint32_t)) goto fail;
+    if (!inf->isInit)
+    {
+        memset(zs, 0, sizeof(z_stream));
+        zs->zalloc = pfs_zalloc;
+        zs->zfree = pfs_zfree;
+        
+        if (inflateInit(zs) != Z_OK)
+            return PFS_OUT_OF_MEMORY;
+        
+        inf->isInit = 1;
+    }
+    else if (inflateReset(zs) != Z_OK)
+    {
+        return PFS_COMPRESSION_ERROR;
+    }
     
-    data = nameData;
-    n = *(uint32_t*)data;
-    p = sizeof(uint32_t);
+    zs->next_in = (Bytef*)src;
+    zs->avail_in = srcLen;
+    zs->next_out = dst;
+    zs->avail_out = dstLen;
     
-    if (n > pfs->count)
-        n = pfs->count;
+    rc = inflate(zs, Z_FINISH);
+    *outLen = dstLen - zs->avail_out;
     
-    /* read the file names from the name data entry */
-    i = 0;
-    while (i < n)
+    return (rc == Z_STREAM_END) ? PFS_OK : PFS_COMPRESSION_ERROR;
+}
+
+#ifdef PFS_USE_LIBDEFLATE
+/* Whole-buffer inflate: no streaming state to reset between blocks, and considerably faster than zlib */
+static int pfs_libdeflate_inflate_block(PfsInflater* inf, uint8_t* dst, uint32_t dstLen, const uint8_t* src, uint32_t srcLen, uint32_t* outLen)
+{
+    size_t actual = 0;
+    
+    if (!inf->decompressor)
     {
-        PfsEntry* ent;
-        uint32_t namelen, k;
-        char* name;
+        inf->decompressor = libdeflate_alloc_decompressor();
+        if (!inf->decompressor) return PFS_OUT_OF_MEMORY;
+    }
+    
+    /* Passing actual lets the block be shorter than dstLen, as with zlib */
+    if (libdeflate_zlib_decompress(inf->decompressor, src, srcLen, dst, dstLen, &actual) != LIBDEFLATE_SUCCESS)
+        return PFS_COMPRESSION_ERROR;
+    
+    *outLen = (uint32_t)actual;
+    return PFS_OK;
+}
+#endif
+
+static void pfs_inflater_release(PfsInflater* inf)
+{
+    if (inf->isInit)
+    {
+        inflateEnd(&inf->stream);
+        inf->isInit = 0;
+    }
+    
+#ifdef PFS_USE_LIBDEFLATE
+    if (inf->decompressor)
+    {
+        libdeflate_free_decompressor(inf->decompressor);
+        inf->decompressor = NULL;
+    }
+#endif
+}
+
+#define PFS_STORED_MAX 65535
+
+/*
+** Writes a zlib stream of stored deflate blocks directly: header, then per chunk the final flag, LEN and ~LEN, then the
+** Adler-32 of the input. Costs a copy and a checksum; deflate at level 0 also clears its hash tables on every reset.
+*/
+static int pfs_store_block(uint8_t* dst, uint32_t dstLen, const uint8_t* src, uint32_t srcLen, uint32_t* outLen)
+{
+    uint32_t chunks = (srcLen + PFS_STORED_MAX - 1) / PFS_STORED_MAX;
+    uint32_t adler = (uint32_t)adler32(adler32(0, Z_NULL, 0), src, srcLen);
+    uint8_t* out = dst;
+    
+    if (chunks == 0) chunks = 1;
+    
+    if (dstLen < 2 + chunks * 5 + srcLen + 4)
+        return PFS_COMPRESSION_ERROR;
+    
+    *out++ = 0x78; /* Deflate, 32K window */
+    *out++ = 0x01; /* No dictionary, fastest; makes the header a multiple of 31 */
+    
+    do
+    {
+        uint32_t n = (srcLen < PFS_STORED_MAX) ? srcLen : PFS_STORED_MAX;
         
-        k = p + sizeof(uint32_t);
+        out[0] = (n == srcLen); /* BFINAL, BTYPE 00 */
+        out[1] = (uint8_t)n;
+        out[2] = (uint8_t)(n >> 8);
+        out[3] = (uint8_t)~n;
+        out[4] = (uint8_t)(~n >> 8);
+        memcpy(out + 5, src, n);
         
-        if (k > length) goto fail;
+        out += 5 + n;
+        src += n;
+        srcLen -= n;
+    }
+    while (srcLen > 0);
+    
+    out[0] = (uint8_t)(adler >> 24);
+    out[1] = (uint8_t)(adler >> 16);
+    out[2] = (uint8_t)(adler >> 8);
+    out[3] = (uint8_t)adler;
+    
+    *outLen = (uint32_t)(out + 4 - dst);
+    return PFS_OK;
+}
+
+static int pfs_zlib_deflate_block(PfsDeflater* def, int level, uint8_t* dst, uint32_t dstLen, const uint8_t* src, uint32_t srcLen, uint32_t* outLen)
+{
+    z_stream* zs = &def->stream;
+    int rc;
+    
+    if (!def->isInit)
+    {
+        memset(zs, 0, sizeof(z_stream));
+        zs->zalloc = pfs_zalloc;
+        zs->zfree = pfs_zfree;
         
-        namelen = *(uint32_t*)(data + p);
-        p = k;
+        if (deflateInit(zs, level) != Z_OK)
+            return PFS_OUT_OF_MEMORY;
         
-        name = (char*)(data + p);
-        p += namelen;
+        def->isInit = 1;
+        def->level = level;
+    }
+    else
+    {
+        if (deflateReset(zs) != Z_OK)
+            return PFS_COMPRESSION_ERROR;
         
-        if (p > length) goto fail;
+        /* Nothing has been fed since the reset, so this only swaps the parameters */
+        if (def->level != level)
+        {
+            if (deflateParams(zs, level, Z_DEFAULT_STRATEGY) != Z_OK)
+                return PFS_COMPRESSION_ERROR;
+            
+            def->level = level;
+        }
+    }
+    
+    zs->next_in = (Bytef*)src;
+    zs->avail_in = srcLen;
+    zs->next_out = dst;
+    zs->avail_out = dstLen;
+    
+    rc = deflate(zs, Z_FINISH);
+    
+    if (rc != Z_STREAM_END)
+        return PFS_COMPRESSION_ERROR;
+    
+    *outLen = dstLen - zs->avail_out;
+    return PFS_OK;
+}
+
+static void pfs_deflater_release(PfsDeflater* def)
+{
+    if (def->isInit)
+    {
+        deflateEnd(&def->stream);
+        def->isInit = 0;
+    }
+}
+
+static const PfsCodec pfs_codec_zlib = { "zlib", pfs_zlib_inflate_block, pfs_zlib_deflate_block };
+
+#ifdef PFS_USE_LIBDEFLATE
+/* Compression stays with zlib so archives come out byte-identical whichever codec reads them */
+static const PfsCodec pfs_codec_libdeflate = { "libdeflate", pfs_libdeflate_inflate_block, pfs_zlib_deflate_block };
+#endif
+
+/* The first is the default */
+static const PfsCodec* const pfs_codecs[] = {
+#ifdef PFS_USE_LIBDEFLATE
+    &pfs_codec_libdeflate,
+#endif
+    &pfs_codec_zlib
+};
+
+#ifdef PFS_USE_LIBDEFLATE
+static const PfsCodec* pfs_codec = &pfs_codec_libdeflate;
+#else
+static const PfsCodec* pfs_codec = &pfs_codec_zlib;
+#endif
+
+int pfs_set_codec(const char* name)
+{
+    uint32_t i;
+    
+    if (!name)
+    {
+        pfs_codec = pfs_codecs[0];
+        return PFS_OK;
+    }
+    
+    for (i = 0; i < sizeof(pfs_codecs) / sizeof(pfs_codecs[0]); i++)
+    {
+        if (strcmp(pfs_codecs[i]->name, name) == 0)
+        {
+            pfs_codec = pfs_codecs[i];
+            return PFS_OK;
+        }
+    }
+    
+    return PFS_NOT_FOUND;
+}
+
+const char* pfs_codec_name(void)
+{
+    return pfs_codec->name;
+}
+
+int pfs_set_allocator(PfsMallocFn mallocFn, PfsReallocFn reallocFn, PfsFreeFn freeFn, void* userdata)
+{
+    if (!mallocFn && !reallocFn && !freeFn)
+    {
+        mallocFn = pfs_default_malloc;
+        reallocFn = pfs_default_realloc;
+        freeFn = pfs_default_free;
+        userdata = NULL;
+    }
+    else if (!mallocFn || !reallocFn || !freeFn)
+    {
+        return PFS_MISUSE;
+    }
+    
+    pfs_malloc_fn = mallocFn;
+    pfs_realloc_fn = reallocFn;
+    pfs_free_fn = freeFn;
+    pfs_alloc_userdata = userdata;
+    
+#ifdef PFS_USE_LIBDEFLATE
+    libdeflate_set_memory_allocator(pfs_libdeflate_malloc, pfs_libdeflate_free);
+#endif
+    return PFS_OK;
+}
+
+/* pfs is only for statistics and may be NULL; dstLen is only the room there is, what the block held is counted */
+static int pfs_inflate_block(PFS* pfs, PfsInflater* inf, uint8_t* dst, uint32_t dstLen, const uint8_t* src, uint32_t srcLen)
+{
+    uint64_t start = pfs_stat_begin();
+    uint32_t outLen = 0;
+    int rc = pfs_codec->inflateBlock(inf, dst, dstLen, src, srcLen, &outLen);
+    
+    pfs_stat_time(pfs, inflateNs, start);
+    pfs_stat_add(pfs, blocksInflated, 1);
+    pfs_stat_add(pfs, bytesInflated, outLen);
+    (void)pfs;
+    return rc;
+}
+
+static int pfs_deflate_block(PFS* pfs, PfsDeflater* def, int level, uint8_t* dst, uint32_t dstLen, const uint8_t* src, uint32_t srcLen, uint32_t* outLen)
+{
+    uint64_t start = pfs_stat_begin();
+    int rc;
+    
+    if (level == PFS_LEVEL_STORE)
+        rc = pfs_store_block(dst, dstLen, src, srcLen, outLen);
+    else
+        rc = pfs_codec->deflateBlock(def, level, dst, dstLen, src, srcLen, outLen);
+    
+    pfs_stat_time(pfs, deflateNs, start);
+    pfs_stat_add(pfs, blocksDeflated, 1);
+    pfs_stat_add(pfs, bytesDeflated, srcLen);
+    (void)pfs;
+    return rc;
+}
+
+#ifdef PFS_HAVE_THREADS
+# define pfs_lock(pfs) do { if ((pfs)->readOnly) pthread_mutex_lock(&(pfs)->lock); } while(0)
+# define pfs_unlock(pfs) do { if ((pfs)->readOnly) pthread_mutex_unlock(&(pfs)->lock); } while(0)
+#else
+# define pfs_lock(pfs) do { } while(0)
+# define pfs_unlock(pfs) do { } while(0)
+#endif
+
+/*
+** The inflater a read on pfs should use. Every reader gets a free one from a small pool, or local if all are busy,
+** so concurrent reads never share a stream, read-only handle or not; pair with pfs_inflater_return().
+*/
+static PfsInflater* pfs_inflater_acquire(PFS* pfs, PfsInflater* local)
+{
+#ifdef PFS_HAVE_THREADS
+    uint32_t i;
+    
+    for (i = 0; i < PFS_INFLATER_POOL; i++)
+    {
+        if (!__sync_lock_test_and_set(&pfs->poolBusy[i], 1))
+            return &pfs->pool[i];
+    }
+    
+    pfs_inflater_init(local);
+    return local;
+#else
+    (void)local;
+    return &pfs->inflater;
+#endif
+}
+
+static void pfs_inflater_return(PFS* pfs, PfsInflater* inf, PfsInflater* local)
+{
+#ifdef PFS_HAVE_THREADS
+    if (inf == local)
+        pfs_inflater_release(local);
+    else
+        __sync_lock_release(&pfs->poolBusy[inf - pfs->pool]);
+#else
+    (void)pfs;
+    (void)inf;
+    (void)local;
+#endif
+}
+
+/*
+** dst must hold at least ent->inflatedLen bytes, and the entry must have been resolved. Each block is still checked
+** against the chain's length: a sidecar supplies that length without the chain ever being walked.
+*/
+static int pfs_inflate_entry(PFS* pfs, PfsInflater* inf, PfsEntry* ent, uint8_t* dst)
+{
+    uint8_t* src = (ent->inserted) ? ent->inserted : pfs->data + ent->offset;
+    uint32_t ilen = ent->inflatedLen;
+    uint32_t dlen = pfs_atomic_load(&ent->deflatedLen); /* Another reader may be publishing it, see pfs_entry_resolve() */
+    uint32_t read = 0;
+    uint32_t pos = 0;
+    int rc;
+    
+    while (read < ilen)
+    {
+        PfsBlock* block = (PfsBlock*)(src + pos);
+        
+        if (pos + sizeof(PfsBlock) > dlen || block->deflatedLen > dlen - pos - sizeof(PfsBlock))
+            return PFS_CORRUPTED;
+        
+        if (block->inflatedLen == 0 || block->inflatedLen > ilen - read)
+            return PFS_CORRUPTED;
+        
+        pos += sizeof(PfsBlock);
+        
+        rc = pfs_inflate_block(pfs, inf, dst + read, ilen - read, src + pos, block->deflatedLen);
+        
+        if (rc) return rc;
+        
+        read += block->inflatedLen;
+        pos += block->deflatedLen;
+    }
+    
+    return PFS_OK;
+}
+
+static int pfs_decompress_index(PFS* pfs, PfsInflater* inf, uint8_t** outData, uint32_t* outLength, uint32_t index)
+{
+    PfsEntry* ent;
+    uint8_t* dst;
+    int rc;
+    
+    if (index >= pfs->count)
+        return PFS_OUT_OF_BOUNDS;
+    
+    ent = &pfs->entries[index];
+    
+    rc = pfs_entry_resolve(pfs, ent);
+    if (rc) return rc;
+    
+    dst = (uint8_t*)pfs_malloc(ent->inflatedLen);
+    
+    if (!dst) return PFS_OUT_OF_MEMORY;
+    
+    pfs_stat_alloc(pfs, ent->inflatedLen);
+    rc = pfs_inflate_entry(pfs, inf, ent, dst);
+    
+    if (rc)
+    {
+        pfs_free(dst);
+        return rc;
+    }
+    
+    *outData = dst;
+    *outLength = ent->inflatedLen;
+    return PFS_OK;
+}
+
+/* Maps every block of a compressed entry to its place in the inflated output */
+static int pfs_index_blocks(const uint8_t* src, uint32_t deflatedLen, uint32_t inflatedLen, PfsBlockRef** outBlocks, uint32_t* outCount)
+{
+    PfsBlockRef* blocks;
+    uint32_t pos = 0;
+    uint32_t read = 0;
+    uint32_t n = 0;
+    
+    /* Count first so the index is a single allocation */
+    while (read < inflatedLen)
+    {
+        PfsBlock* block = (PfsBlock*)(src + pos);
+        
+        if (pos + sizeof(PfsBlock) > deflatedLen || block->deflatedLen > deflatedLen - pos - sizeof(PfsBlock))
+            return PFS_CORRUPTED;
+        
+        if (block->inflatedLen == 0 || block->inflatedLen > inflatedLen - read)
+            return PFS_CORRUPTED;
+        
+        pos += sizeof(PfsBlock) + block->deflatedLen;
+        read += block->inflatedLen;
+        n++;
+    }
+    
+    blocks = (PfsBlockRef*)pfs_malloc(sizeof(PfsBlockRef) * (n ? n : 1));
+    if (!blocks) return PFS_OUT_OF_MEMORY;
+    
+    pos = 0;
+    read = 0;
+    n = 0;
+    
+    while (read < inflatedLen)
+    {
+        PfsBlock* block = (PfsBlock*)(src + pos);
+        PfsBlockRef* ref = &blocks[n++];
+        
+        ref->srcPos = pos + sizeof(PfsBlock);
+        ref->deflatedLen = block->deflatedLen;
+        ref->dstPos = read;
+        ref->inflatedLen = block->inflatedLen;
+        
+        pos = ref->srcPos + block->deflatedLen;
+        read += block->inflatedLen;
+    }
+    
+    *outBlocks = blocks;
+    *outCount = n;
+    return PFS_OK;
+}
+
+static void pfs_shared_release(PfsShared* sh)
+{
+#ifdef PFS_HAVE_THREADS
+    if (__sync_sub_and_fetch(&sh->refs, 1) == 0)
+#else
+    if (--sh->refs == 0)
+#endif
+        pfs_free(sh);
+}
+
+static void pfs_cache_unlink(PfsCache* cache, PfsShared* sh)
+{
+    if (sh->prev) sh->prev->next = sh->next;
+    else cache->head = sh->next;
+    
+    if (sh->next) sh->next->prev = sh->prev;
+    else cache->tail = sh->prev;
+    
+    sh->prev = NULL;
+    sh->next = NULL;
+}
+
+static void pfs_cache_push_front(PfsCache* cache, PfsShared* sh)
+{
+    sh->prev = NULL;
+    sh->next = cache->head;
+    
+    if (cache->head) cache->head->prev = sh;
+    else cache->tail = sh;
+    
+    cache->head = sh;
+}
+
+#define PFS_CACHE_MIN_TABLE 16
+#define pfs_cache_home(index, mask) (((index) * 2654435769U) & (mask))
+
+static PfsShared* pfs_cache_find(PfsCache* cache, uint32_t index)
+{
+    uint32_t mask = cache->tableSize - 1;
+    PfsShared* sh;
+    uint32_t i;
+    
+    if (!cache->table) return NULL;
+    
+    i = pfs_cache_home(index, mask);
+    
+    while ((sh = cache->table[i]) != NULL)
+    {
+        if (sh->index == index)
+            return sh;
+        
+        i = (i + 1) & mask;
+    }
+    
+    return NULL;
+}
+
+/* The table always has room, see pfs_cache_reserve() */
+static void pfs_cache_table_insert(PfsCache* cache, PfsShared* sh)
+{
+    uint32_t mask = cache->tableSize - 1;
+    uint32_t i = pfs_cache_home(sh->index, mask);
+    
+    while (cache->table[i])
+    {
+        i = (i + 1) & mask;
+    }
+    
+    cache->table[i] = sh;
+}
+
+/* Backward-shift deletion, as pfs_index_remove() */
+static void pfs_cache_table_remove(PfsCache* cache, PfsShared* sh)
+{
+    PfsShared** table = cache->table;
+    uint32_t mask = cache->tableSize - 1;
+    uint32_t i = pfs_cache_home(sh->index, mask);
+    uint32_t j;
+    
+    while (table[i] != sh)
+    {
+        i = (i + 1) & mask;
+    }
+    
+    j = i;
+    
+    for (;;)
+    {
+        uint32_t home;
+        
+        j = (j + 1) & mask;
+        
+        if (!table[j])
+            break;
+        
+        home = pfs_cache_home(table[j]->index, mask);
+        
+        if ((i < j) ? (home > i && home <= j) : (home > i || home <= j))
+            continue;
+        
+        table[i] = table[j];
+        i = j;
+    }
+    
+    table[i] = NULL;
+}
+
+/* Makes room for one more cached entry at a load factor of 1/2 or lower, rehashing from the LRU list */
+static int pfs_cache_reserve(PfsCache* cache)
+{
+    PfsShared** table;
+    PfsShared* sh;
+    uint32_t cap = cache->tableSize;
+    
+    if ((cache->count + 1) * 2 <= cap)
+        return PFS_OK;
+    
+    cap = (cap) ? cap * 2 : PFS_CACHE_MIN_TABLE;
+    table = (PfsShared**)pfs_calloc(cap, sizeof(PfsShared*));
+    if (!table) return PFS_OUT_OF_MEMORY;
+    
+    pfs_free_if_exists(cache->table);
+    cache->table = table;
+    cache->tableSize = cap;
+    
+    for (sh = cache->head; sh; sh = sh->next)
+    {
+        pfs_cache_table_insert(cache, sh);
+    }
+    
+    return PFS_OK;
+}
+
+/* Drops the cache's reference to an inflated entry; callers still holding it keep a valid buffer */
+static void pfs_cache_evict(PfsCache* cache, PfsShared* sh)
+{
+    pfs_cache_unlink(cache, sh);
+    pfs_cache_table_remove(cache, sh);
+    cache->bytes -= sh->length;
+    cache->count--;
+    pfs_shared_release(sh);
+}
+
+static void pfs_cache_drop(PFS* pfs, PfsEntry* ent)
+{
+    PfsShared* sh = pfs_cache_find(&pfs->cache, (uint32_t)(ent - pfs->entries));
+    
+    if (sh)
+        pfs_cache_evict(&pfs->cache, sh);
+}
+
+/* Evicts least recently used entries until extra more bytes fit in the budget */
+static void pfs_cache_trim(PFS* pfs, uint32_t extra)
+{
+    PfsCache* cache = &pfs->cache;
+    
+    while (cache->tail && cache->bytes + extra > cache->budget)
+    {
+        pfs_cache_evict(cache, cache->tail);
+        cache->evictions++;
+    }
+}
+
+static int pfs_sort_by_offset(const void* va, const void* vb)
+{
+    const PfsEntry* a = (const PfsEntry*)va;
+    const PfsEntry* b = (const PfsEntry*)vb;
+    
+    /* Entries sharing data are told apart by CRC, matching the order pfs_layout() writes their names in */
+    if (a->offset != b->offset)
+        return (a->offset < b->offset) ? -1 : 1;
+    
+    return (a->crc < b->crc) ? -1 : (a->crc > b->crc);
+}
+
+/* Inflates the name data entry, which is always the last entry by offset, and indexes the names */
+static int pfs_load_names(PFS* pfs)
+{
+    PfsEntry* nameEnt;
+    uint8_t* data;
+    uint32_t length, p, n, i;
+    int foundTraceDotDbg = 0;
+    int rc;
+    
+    /* Past count, so this can run while read-only lookups go by CRC */
+    n = pfs->dirCount - 1;
+    nameEnt = &pfs->entries[n];
+    
+    rc = pfs_entry_resolve(pfs, nameEnt);
+    if (rc) return rc;
+    
+    length = nameEnt->inflatedLen;
+    data = (uint8_t*)pfs_malloc(length);
+    if (!data) return PFS_OUT_OF_MEMORY;
+    
+    pfs_stat_alloc(pfs, length);
+    rc = pfs_inflate_entry(pfs, &pfs->inflater, nameEnt, data);
+    if (rc) goto fail;
+    
+    pfs->fileNamesLen = nameEnt->deflatedLen;
+    rc = PFS_CORRUPTED;
+    
+    if (length < sizeof(uint32_t)) goto fail;
+    
+    n = *(uint32_t*)data;
+    p = sizeof(uint32_t);
+    
+    if (n > pfs->count)
+        n = pfs->count;
+    
+    /* Indexed as they are read; a failed load leaves no index behind */
+    pfs_index_free(pfs);
+    rc = pfs_index_rebuild(pfs, n);
+    if (rc) goto fail;
+    
+    rc = PFS_CORRUPTED;
+    
+    /* read the file names from the name data entry */
+    i = 0;
+    while (i < n)
+    {
+        PfsEntry* ent;
+        uint32_t namelen, k, crc;
+        char* name;
+        
+        k = p + sizeof(uint32_t);
+        
+        if (k > length) goto fail;
+        
+        namelen = *(uint32_t*)(data + p);
+        p = k;
+        
+        name = (char*)(data + p);
+        p += namelen;
+        
+        if (p > length) goto fail;
+        
+        if (!foundTraceDotDbg && strcmp(name, "trace.dbg") == 0)
+        {
+            n--;
+            foundTraceDotDbg = 1;
+            continue;
+        }
+        
+        ent = &pfs->entries[i];
+        ent->name = name;
+        
+        /*
+        ** The index hashes by CRC, so it has to be the name's. Only the archives listing trace.dbg pair names with
+        ** other entries' CRCs, and those load at open; a deferred load can't change CRCs readers are comparing.
+        */
+        crc = pfs_crc(name, namelen); /* CRC includes the null terminator */
+        
+        if (ent->crc != crc)
+        {
+            if (pfs->namesPending) goto fail;
+            ent->crc = crc;
+        }
+        
+        pfs_index_insert(pfs, i);
+        
+        i++;
+    }
+    
+    /*
+    ** A deferred load runs while CRC lookups read count without a lock, so only the load at open may change it;
+    ** pfs_open_impl() loads archives listing trace.dbg then. Here the names can only be short of the directory.
+    */
+    if (pfs->count != n)
+    {
+        if (pfs->namesPending) goto fail;
+        pfs->count = n;
+    }
+    
+    pfs->nameData = data;
+    pfs_atomic_clear(&pfs->namesPending);
+    return PFS_OK;
+    
+fail:
+    pfs_free(data);
+    pfs_index_free(pfs);
+    
+    if (pfs->count != pfs->dirCount - 1)
+        pfs->count = pfs->dirCount - 1;
+    
+    return rc;
+}
+
+static int pfs_require_names(PFS* pfs)
+{
+    if (!pfs_atomic_load(&pfs->namesPending))
+        return PFS_OK;
+    
+#ifdef PFS_HAVE_THREADS
+    /* Read-only handles load the names once, whichever reader needs them first */
+    if (pfs->readOnly)
+    {
+        int rc = PFS_OK;
+        
+        pthread_mutex_lock(&pfs->lock);
+        
+        if (pfs->namesPending)
+            rc = pfs_load_names(pfs);
+        
+        pthread_mutex_unlock(&pfs->lock);
+        return rc;
+    }
+#endif
+    
+    return pfs_load_names(pfs);
+}
+
+static void pfs_release_data(uint8_t* data, uint32_t length, int owner)
+{
+    if (!data) return;
+    
+    switch (owner)
+    {
+    case PFS_DATA_MALLOC:
+        pfs_free(data);
+        break;
+#ifndef _WIN32
+    case PFS_DATA_MMAP:
+        munmap(data, length);
+        break;
+#endif
+    default:
+        (void)length;
+        break;
+    }
+}
+
+static int pfs_open_impl(PFS** outPfs, const uint8_t* data, uint32_t length, int owner, int flags)
+{
+    PFS* pfs;
+    uint32_t p, n, i;
+    PfsHeader* h;
+    int rc = PFS_CORRUPTED;
+    
+    pfs = (PFS*)pfs_malloc(sizeof(PFS));
+    
+    if (!pfs)
+    {
+        rc = PFS_OUT_OF_MEMORY;
+        goto fail_alloc;
+    }
+    
+    pfs->count = 0;
+    pfs->length = length;
+    pfs->entries = NULL;
+    pfs->cold = NULL;
+    pfs->slots = NULL;
+    pfs->slotCount = 0;
+    pfs->data = (uint8_t*)data;
+    pfs->nameData = NULL;
+    pfs->arena = NULL;
+    pfs->dirOffset = 0;
+    pfs->dirCount = 0;
+    pfs->namesPending = 0;
+    pfs->unsaved = 0;
+    pfs->dataOwner = owner;
+    pfs->readOnly = 0;
+    pfs->level = PFS_LEVEL_BEST;
+    pfs->blockSize = PFS_BLOCK_SIZE_DEFAULT;
+    pfs->extLevels = NULL;
+    pfs->extLevelCount = 0;
+    pfs_inflater_init(&pfs->inflater);
+    pfs->deflater.isInit = 0;
+    memset(&pfs->cache, 0, sizeof(PfsCache));
+    pfs->fileLength = 0;
+    pfs->fileNamesLen = 0;
+    pfs->dedupSaved = 0;
+#ifndef PFS_NO_STATS
+    memset(&pfs->stats, 0, sizeof(PfsStats));
+#endif
+    
+#ifdef PFS_HAVE_THREADS
+    for (i = 0; i < PFS_INFLATER_POOL; i++)
+    {
+        pfs_inflater_init(&pfs->pool[i]);
+        pfs->poolBusy[i] = 0;
+    }
+    
+    if (flags & PFS_OPEN_READ_ONLY)
+    {
+        if (pthread_mutex_init(&pfs->lock, NULL) != 0)
+        {
+            pfs_free(pfs);
+            rc = PFS_OUT_OF_MEMORY;
+            goto fail_alloc;
+        }
+    }
+#endif
+    
+    pfs->readOnly = (flags & PFS_OPEN_READ_ONLY) != 0;
+    
+    p = sizeof(PfsHeader);
+    
+    if (p > length) goto fail;
+    
+    h = (PfsHeader*)data;
+    
+    if (memcmp(&h->signature, "PFS ", sizeof(uint32_t)) != 0)
+        goto fail;
+    
+    p = h->offset;
+    i = p + sizeof(uint32_t);
+    
+    if (i > length) goto fail;
+    
+    n = *(uint32_t*)(data + p);
+    p = i;
+    pfs->dirOffset = p;
+    
+    /* Must have at least one file + the name data entry to have any real content */
+    if (n <= 1) goto done;
+    
+    i = pfs_pow2_greater_or_equal(n);
+    
+    pfs->entries = (PfsEntry*)pfs_malloc(sizeof(PfsEntry) * i);
+    if (!pfs->entries) goto oom;
+    
+    pfs->cold = (PfsEntryCold*)pfs_malloc(sizeof(PfsEntryCold) * i);
+    if (!pfs->cold)
+    {
+    oom:
+        rc = PFS_OUT_OF_MEMORY;
+        goto fail;
+    }
+    
+    for (i = 0; i < n; i++)
+    {
+        PfsFileEntry* src = (PfsFileEntry*)(data + p);
+        PfsEntry ent;
+        
+        p += sizeof(PfsFileEntry);
+        
+        if (p > length) goto fail;
+        
+        ent.name = NULL;
+        ent.crc = src->crc;
+        ent.offset = src->offset;
+        ent.inflatedLen = src->inflatedLen;
+        ent.deflatedLen = PFS_DEFLATED_LEN_UNKNOWN;
+        ent.inserted = NULL;
+        
+        if (!(flags & PFS_OPEN_LAZY) && pfs_block_chain_length(data, length, ent.offset, ent.inflatedLen, &ent.deflatedLen))
+            goto fail;
+        
+        pfs->entries[i] = ent;
+    }
+    
+    qsort(pfs->entries, n, sizeof(PfsEntry), pfs_sort_by_offset);
+    
+    /* Nothing here is owned or rewritten yet */
+    for (i = 0; i < n; i++)
+    {
+        PfsEntryCold* cold = &pfs->cold[i];
+        
+        cold->fileOffset = pfs->entries[i].offset;
+        cold->insertedIsCopy = 0;
+        cold->level = PFS_LEVEL_DEFAULT;
+    }
+    
+    pfs->count = n - 1;
+    pfs->dirCount = n;
+    
+    pfs->fileLength = length;
+    pfs->fileDirOffset = h->offset;
+    pfs->fileDirSize = sizeof(uint32_t) + sizeof(PfsFileEntry) * n;
+    pfs->fileDirCrc = pfs_crc(data + h->offset, pfs->fileDirSize);
+    
+    if (flags & PFS_OPEN_DIRECTORY_ONLY)
+    {
+        const PfsFileEntry* dir = (const PfsFileEntry*)(data + pfs->dirOffset);
+        uint32_t traceCrc = pfs_crc("trace.dbg", sizeof("trace.dbg"));
+        
+        /* CRC lookups need the directory sorted the way pfs_write_to_disk writes it, and a count that stays put */
+        for (i = 0; i < n; i++)
+        {
+            if ((i > 0 && dir[i - 1].crc > dir[i].crc) || dir[i].crc == traceCrc)
+                break;
+        }
+        
+        if (i == n)
+        {
+            pfs->namesPending = 1;
+            goto done;
+        }
+    }
+    
+    rc = pfs_load_names(pfs);
+    if (rc) goto fail;
+done:
+    *outPfs = pfs;
+    return PFS_OK;
+    
+fail:
+    pfs_close(pfs);
+    *outPfs = NULL;
+    return rc;
+    
+fail_alloc:
+    pfs_release_data((uint8_t*)data, length, owner);
+    *outPfs = NULL;
+    return rc;
+}
+
+static int pfs_read_file(PFS** outPfs, const char* path, int flags)
+{
+    FILE* fp;
+    uint8_t* data;
+    uint32_t length;
+    uint64_t start = pfs_stat_begin();
+    int rc = PFS_NOT_FOUND;
+    
+    fp = fopen(path, "rb");
+    if (!fp) goto fail;
+    
+    fseek(fp, 0, SEEK_END);
+    length = (uint32_t)ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    
+    if (length == 0)
+        goto fail_file_open;
+    
+    data = (uint8_t*)pfs_malloc(length);
+    
+    if (!data)
+    {
+        rc = PFS_OUT_OF_MEMORY;
+        goto fail_file_open;
+    }
+    
+    if (fread(data, sizeof(uint8_t), length, fp) != length)
+    {
+        pfs_free(data);
+        rc = PFS_FILE_ERROR;
+        goto fail_file_open;
+    }
+    
+    start = pfs_stat_begin() - start;
+    rc = pfs_open_impl(outPfs, data, length, PFS_DATA_MALLOC, flags);
+    
+    /* Counted once there is a handle to count it against */
+    if (rc == PFS_OK)
+    {
+        pfs_stat_add(*outPfs, ioNs, start);
+        pfs_stat_add(*outPfs, bytesRead, length);
+        pfs_stat_alloc(*outPfs, length);
+    }
+    
+fail_file_open:
+    fclose(fp);
+fail:
+    return rc;
+}
+
+#ifndef _WIN32
+static int pfs_map_file(PFS** outPfs, const char* path, int flags)
+{
+    struct stat st;
+    void* data;
+    uint32_t length;
+    int fd;
+    int rc = PFS_NOT_FOUND;
+    
+    fd = open(path, O_RDONLY);
+    if (fd == -1) goto fail;
+    
+    if (fstat(fd, &st) || st.st_size <= 0 || (uint64_t)st.st_size > 0xffffffffU)
+    {
+        rc = PFS_FILE_ERROR;
+        goto fail_file_open;
+    }
+    
+    length = (uint32_t)st.st_size;
+    data = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    
+    if (data == MAP_FAILED)
+    {
+        rc = PFS_FILE_ERROR;
+        goto fail_file_open;
+    }
+    
+    /* Entries are inflated on demand, so readahead past the pages actually touched is wasted I/O */
+    madvise(data, length, MADV_RANDOM);
+    
+    rc = pfs_open_impl(outPfs, (const uint8_t*)data, length, PFS_DATA_MMAP, flags);
+    
+fail_file_open:
+    close(fd);
+fail:
+    return rc;
+}
+#endif
+
+static int pfs_open_ex_impl(PFS** outPfs, const char* path, int flags)
+{
+    if (!outPfs || !path)
+        return PFS_MISUSE;
+    
+#ifndef _WIN32
+    if (flags & PFS_OPEN_MMAP)
+        return pfs_map_file(outPfs, path, flags);
+#endif
+    
+    return pfs_read_file(outPfs, path, flags);
+}
+
+int pfs_open_ex(PFS** outPfs, const char* path, int flags)
+{
+    uint64_t start = pfs_trace_begin();
+    int rc = pfs_open_ex_impl(outPfs, path, flags);
+    
+    pfs_trace_end(PFS_TRACE_OPEN, path, (rc == PFS_OK) ? (*outPfs)->length : 0, start, rc);
+    return rc;
+}
+
+int pfs_open(PFS** outPfs, const char* path)
+{
+    return pfs_open_ex(outPfs, path, 0);
+}
+
+int pfs_open_mmap(PFS** outPfs, const char* path)
+{
+    return pfs_open_ex(outPfs, path, PFS_OPEN_MMAP);
+}
+
+static int pfs_open_from_memory_ex_impl(PFS** outPfs, const void* data, uint32_t length, int flags)
+{
+    uint8_t* copy;
+    int rc;
+    
+    if (!outPfs || !data || !length)
+    {
+        rc = PFS_MISUSE;
+        goto fail;
+    }
+    
+    if (flags & PFS_OPEN_NO_COPY)
+        return pfs_open_impl(outPfs, (const uint8_t*)data, length, PFS_DATA_BORROWED, flags);
+    
+    copy = (uint8_t*)pfs_malloc(length);
+    
+    if (!copy)
+    {
+        rc = PFS_OUT_OF_MEMORY;
+        goto fail;
+    }
+    
+    memcpy(copy, data, length);
+    
+    rc = pfs_open_impl(outPfs, copy, length, PFS_DATA_MALLOC, flags);
+    
+    if (rc == PFS_OK)
+        pfs_stat_alloc(*outPfs, length);
+    
+fail:
+    return rc;
+}
+
+int pfs_open_from_memory_ex(PFS** outPfs, const void* data, uint32_t length, int flags)
+{
+    uint64_t start = pfs_trace_begin();
+    int rc = pfs_open_from_memory_ex_impl(outPfs, data, length, flags);
+    
+    pfs_trace_end(PFS_TRACE_OPEN, NULL, (rc == PFS_OK) ? length : 0, start, rc);
+    return rc;
+}
+
+int pfs_open_from_memory(PFS** outPfs, const void* data, uint32_t length)
+{
+    return pfs_open_from_memory_ex(outPfs, data, length, 0);
+}
+
+int pfs_open_from_memory_no_copy(PFS** outPfs, const void* data, uint32_t length)
+{
+    uint64_t start = pfs_trace_begin();
+    int rc = pfs_open_impl(outPfs, (const uint8_t*)data, length, PFS_DATA_BORROWED, 0);
+    
+    pfs_trace_end(PFS_TRACE_OPEN, NULL, (rc == PFS_OK) ? length : 0, start, rc);
+    return rc;
+}
+
+int pfs_create_new(PFS** outPfs)
+{
+    PFS* pfs;
+    
+    if (!outPfs) return PFS_MISUSE;
+    
+    pfs = (PFS*)pfs_malloc(sizeof(PFS));
+    
+    if (!pfs) return PFS_OUT_OF_MEMORY;
+    
+    memset(pfs, 0, sizeof(PFS));
+    pfs->level = PFS_LEVEL_BEST;
+    pfs->blockSize = PFS_BLOCK_SIZE_DEFAULT;
+    *outPfs = pfs;
+    return PFS_OK;
+}
+
+void pfs_close(PFS* pfs)
+{
+    if (pfs)
+    {
+        PfsEntry* entries = pfs->entries;
+        
+#ifndef PFS_NO_STATS
+        pfs_stat_add_to(&pfs_global_stats.lookups, pfs->stats.lookups);
+        pfs_stat_add_to(&pfs_global_stats.lookupMisses, pfs->stats.lookupMisses);
+        pfs_stat_add_to(&pfs_global_stats.probes, pfs->stats.probes);
+#endif
+        
+        while (pfs->cache.head)
+        {
+            pfs_cache_evict(&pfs->cache, pfs->cache.head);
+        }
+        
+        pfs_free_if_exists(pfs->cache.table);
+        pfs->cache.table = NULL;
+        
+        if (entries)
+        {
+            uint32_t n = pfs->count;
+            uint32_t i;
+            
+            for (i = 0; i < n; i++)
+            {
+                PfsEntry* ent = &entries[i];
+                PfsEntryCold* cold = &pfs->cold[i];
+                
+                if (ent->inserted && cold->insertedIsCopy)
+                {
+                    pfs_free(ent->inserted);
+                }
+                ent->inserted = NULL;
+                ent->name = NULL;
+            }
+            
+            pfs_free(entries);
+            pfs->entries = NULL;
+        }
+        
+        pfs_free_if_exists(pfs->cold);
+        pfs->cold = NULL;
+        
+        if (pfs->slots)
+        {
+            pfs_free(pfs->slots);
+            pfs->slots = NULL;
+        }
+        
+        pfs_release_data(pfs->data, pfs->length, pfs->dataOwner);
+        pfs->data = NULL;
+        
+        if (pfs->nameData)
+        {
+            pfs_free(pfs->nameData);
+            pfs->nameData = NULL;
+        }
+        
+        pfs_arena_free(pfs);
+        pfs_free_if_exists(pfs->extLevels);
+        
+        pfs_inflater_release(&pfs->inflater);
+        pfs_deflater_release(&pfs->deflater);
+        
+#ifdef PFS_HAVE_THREADS
+        {
+            uint32_t i;
+            
+            for (i = 0; i < PFS_INFLATER_POOL; i++)
+            {
+                pfs_inflater_release(&pfs->pool[i]);
+            }
+        }
+        
+        if (pfs->readOnly)
+            pthread_mutex_destroy(&pfs->lock);
+#endif
+        
+        pfs_free(pfs);
+    }
+}
+
+uint32_t pfs_file_count(PFS* pfs)
+{
+    return (pfs) ? pfs->count : 0;
+}
+
+#define pfs_level_is_valid(level) ((level) >= PFS_LEVEL_ADAPTIVE && (level) <= PFS_LEVEL_BEST && (level) != PFS_LEVEL_DEFAULT)
+
+#define PFS_ADAPTIVE_SAMPLE 16384
+#define PFS_ADAPTIVE_MIN_SAMPLE 512
+#define PFS_ADAPTIVE_UNIFORMITY 224 /* Out of 256 */
+
+/*
+** Picks a level for one block of PFS_LEVEL_ADAPTIVE data. Counts how often two sampled bytes are equal: uniformly
+** random bytes collide 1 time in 256, text and most raw formats many times more. Already compressed data (JPEG,
+** PNG, Ogg, nested zlib) comes close to uniform, and deflate can't shrink it, so it is stored.
+*/
+static int pfs_adaptive_level(const uint8_t* data, uint32_t length)
+{
+    uint32_t counts[256];
+    uint32_t n = (length < PFS_ADAPTIVE_SAMPLE) ? length : PFS_ADAPTIVE_SAMPLE;
+    uint32_t pairs = 0;
+    uint32_t i;
+    
+    if (n < PFS_ADAPTIVE_MIN_SAMPLE)
+        return PFS_LEVEL_BEST;
+    
+    memset(counts, 0, sizeof(counts));
+    
+    for (i = 0; i < n; i++)
+    {
+        counts[data[i]]++;
+    }
+    
+    for (i = 0; i < 256; i++)
+    {
+        pairs += counts[i] * (counts[i] - 1);
+    }
+    
+    /* Collisions at most 256 / PFS_ADAPTIVE_UNIFORMITY times those of uniform data */
+    return (pairs <= n * (n - 1) / PFS_ADAPTIVE_UNIFORMITY) ? PFS_LEVEL_STORE : PFS_LEVEL_BEST;
+}
+
+#define PFS_COMPRESS_SCRATCH 16384
+
+/* Leaves ent owning the compressed chain; outLevel gets the level the entry reports, see pfs_file_compression_level() */
+static int pfs_compress(PFS* pfs, PfsEntry* ent, PfsDeflater* def, const void* data, uint32_t length, int level, uint32_t blockSize, int* outLevel)
+{
+    const uint8_t* ptr = (const uint8_t*)data;
+    uint32_t full = length / blockSize;
+    uint32_t rem = length % blockSize;
+    uint32_t stored = 0;
+    uint32_t cap, dlen;
+    uint8_t scratch[PFS_COMPRESS_SCRATCH];
+    uint8_t* out;
+    uint8_t* shrunk;
+    int rc;
+    
+    /*
+    ** Reserve the worst case for every block up front, then give back what compression saved. Small entries do that
+    ** on the stack and take one allocation of the exact size, so a pool behind pfs_set_allocator() sees no realloc.
+    */
+    cap = full * (sizeof(PfsBlock) + compressBound(blockSize));
+    if (rem) cap += sizeof(PfsBlock) + compressBound(rem);
+    
+    if (cap <= sizeof(scratch))
+    {
+        out = scratch;
+    }
+    else
+    {
+        out = (uint8_t*)pfs_malloc(cap);
+        if (!out) return PFS_OUT_OF_MEMORY;
+        
+        pfs_stat_alloc(pfs, cap);
+    }
+    
+    dlen = 0;
+    
+    while (length > 0)
+    {
+        uint32_t r = (length < blockSize) ? length : blockSize;
+        int blockLevel = (level == PFS_LEVEL_ADAPTIVE) ? pfs_adaptive_level(ptr, r) : level;
+        PfsBlock block;
+        
+        block.inflatedLen = r;
+        
+        if (blockLevel == PFS_LEVEL_STORE)
+            stored += r;
+        
+        rc = pfs_deflate_block(pfs, def, blockLevel, out + dlen + sizeof(block), cap - dlen - sizeof(block), ptr, r, &block.deflatedLen);
+        if (rc) goto fail;
+        
+        memcpy(out + dlen, &block, sizeof(block));
+        dlen += sizeof(block) + block.deflatedLen;
+        
+        length -= r;
+        ptr += r;
+    }
+    
+    if (out == scratch)
+    {
+        shrunk = (uint8_t*)pfs_malloc(dlen ? dlen : 1);
+        if (!shrunk) return PFS_OUT_OF_MEMORY;
+        
+        pfs_stat_alloc(pfs, dlen);
+        memcpy(shrunk, scratch, dlen);
+        out = shrunk;
+    }
+    else
+    {
+        shrunk = (uint8_t*)pfs_realloc(out, dlen);
+        if (shrunk) out = shrunk;
+    }
+    
+    ent->inserted = out;
+    ent->inflatedLen = (uint32_t)(ptr - (const uint8_t*)data);
+    ent->deflatedLen = dlen;
+    
+    /* Adaptive entries report whichever level most of their data got */
+    if (level == PFS_LEVEL_ADAPTIVE)
+        level = (stored > ent->inflatedLen / 2) ? PFS_LEVEL_STORE : PFS_LEVEL_BEST;
+    
+    if (outLevel)
+        *outLevel = level;
+    
+    return PFS_OK;
+    
+fail:
+    if (out != scratch)
+        pfs_free(out);
+    return rc;
+}
+
+static int pfs_sort_by_crc(const void* va, const void* vb)
+{
+    const PfsFileEntry* a = (const PfsFileEntry*)va;
+    const PfsFileEntry* b = (const PfsFileEntry*)vb;
+    
+    return (a->crc < b->crc) ? -1 : 1;
+}
+
+static void pfs_layout_free(PfsLayout* layout)
+{
+    pfs_free_if_exists(layout->offsets);
+    pfs_free_if_exists(layout->fileEntries);
+    pfs_free_if_exists(layout->names.inserted);
+}
+
+static int pfs_sort_uint32(const void* va, const void* vb)
+{
+    uint32_t a = *(const uint32_t*)va;
+    uint32_t b = *(const uint32_t*)vb;
+    
+    return (a < b) ? -1 : (a > b);
+}
+
+/* Orders (offset, crc, ...) records the way pfs_open_impl() orders entries */
+static int pfs_sort_offset_crc(const void* va, const void* vb)
+{
+    const uint32_t* a = (const uint32_t*)va;
+    const uint32_t* b = (const uint32_t*)vb;
+    
+    if (a[0] != b[0])
+        return (a[0] < b[0]) ? -1 : 1;
+    
+    return (a[1] < b[1]) ? -1 : (a[1] > b[1]);
+}
+
+#define pfs_entry_source(pfs, ent) (((ent)->inserted) ? (ent)->inserted : ((pfs)->data + (ent)->offset))
+
+#define PFS_DEDUP_SAMPLE 64
+
+/* Finds entries whose compressed data is byte-identical so the writer stores it once */
+typedef struct {
+    uint32_t*   slots;      /* Entry index + 1, 0 = empty */
+    uint32_t*   hashes;     /* Per entry */
+    uint32_t    mask;
+} PfsDedup;
+
+/* Compressed data is close to random, so its length and a few bytes from each end make a good fingerprint */
+static uint32_t pfs_blob_hash(const uint8_t* data, uint32_t len)
+{
+    uint32_t n = (len < PFS_DEDUP_SAMPLE) ? len : PFS_DEDUP_SAMPLE;
+    
+    return (pfs_hash((const char*)data, n) ^ (pfs_hash((const char*)data + len - n, n) * 31)) + len;
+}
+
+/* Returns an earlier entry with the same compressed data, or records this one and returns -1 */
+static int pfs_dedup_find_or_add(PFS* pfs, PfsDedup* dedup, uint32_t index)
+{
+    PfsEntry* ent = &pfs->entries[index];
+    const uint8_t* src = pfs_entry_source(pfs, ent);
+    uint32_t hash = pfs_blob_hash(src, ent->deflatedLen);
+    uint32_t i = hash & dedup->mask;
+    
+    while (dedup->slots[i] != 0)
+    {
+        uint32_t other = dedup->slots[i] - 1;
+        PfsEntry* oent = &pfs->entries[other];
+        
+        if (dedup->hashes[other] == hash && oent->deflatedLen == ent->deflatedLen && oent->inflatedLen == ent->inflatedLen)
+        {
+            const uint8_t* osrc = pfs_entry_source(pfs, oent);
+            
+            /* Same bytes in memory (shared duplicates, already deduplicated archives) need no compare */
+            if (osrc == src || memcmp(osrc, src, ent->deflatedLen) == 0)
+                return (int)other;
+        }
+        
+        i = (i + 1) & dedup->mask;
+    }
+    
+    dedup->hashes[index] = hash;
+    dedup->slots[i] = index + 1;
+    return -1;
+}
+
+/*
+** Places every entry and builds the compressed name data entry and directory.
+** With appendOnly, entries already in the backing file keep their place and everything else goes after its end.
+** Entries with byte-identical compressed data share one copy; pfs_deduplicated_bytes() reports the saving.
+*/
+static int pfs_layout(PFS* pfs, PfsLayout* layout, int appendOnly)
+{
+    PfsFileEntry* fileEntries;
+    PfsDedup dedup;
+    uint8_t* nameData;
+    uint32_t* order;
+    uint32_t p, n, i, c, len;
+    int rc;
+    
+    rc = pfs_require_names(pfs);
+    if (rc) return rc;
+    
+    c = pfs->count;
+    
+    layout->names.inserted = NULL;
+    layout->offsets = (uint32_t*)pfs_malloc(sizeof(uint32_t) * (c + 1));
+    layout->fileEntries = fileEntries = (PfsFileEntry*)pfs_malloc(sizeof(PfsFileEntry) * (c + 1));
+    
+    dedup.mask = pfs_pow2_greater_or_equal(c * 2 + 2) - 1;
+    dedup.slots = (uint32_t*)pfs_calloc(dedup.mask + 1, sizeof(uint32_t));
+    dedup.hashes = (uint32_t*)pfs_malloc(sizeof(uint32_t) * (c + 1));
+    
+    if (!layout->offsets || !fileEntries || !dedup.slots || !dedup.hashes)
+    {
+        rc = PFS_OUT_OF_MEMORY;
+        goto abort;
+    }
+    
+    /* Entries staying put go in first, so new entries can share their data too */
+    n = sizeof(uint32_t);
+    
+    for (i = 0; i < c; i++)
+    {
+        PfsEntry* ent = &pfs->entries[i];
+        
+        rc = pfs_entry_resolve(pfs, ent);
+        if (rc) goto abort;
+        
+        if (appendOnly && pfs->cold[i].fileOffset != PFS_OFFSET_NONE)
+        {
+            layout->offsets[i] = pfs->cold[i].fileOffset;
+            pfs_dedup_find_or_add(pfs, &dedup, i);
+        }
+        else
+        {
+            layout->offsets[i] = PFS_OFFSET_NONE;
+        }
+        
+        n += sizeof(uint32_t) + strlen(ent->name) + 1;
+    }
+    
+    /* Lay the rest out back to back, once per distinct payload */
+    p = (appendOnly) ? pfs->fileLength : sizeof(PfsHeader);
+    layout->start = p;
+    pfs->dedupSaved = 0;
+    
+    for (i = 0; i < c; i++)
+    {
+        PfsEntry* ent = &pfs->entries[i];
+        PfsFileEntry* fent = &fileEntries[i];
+        
+        if (layout->offsets[i] == PFS_OFFSET_NONE)
+        {
+            int dup = pfs_dedup_find_or_add(pfs, &dedup, i);
+            
+            if (dup >= 0)
+            {
+                layout->offsets[i] = layout->offsets[dup];
+                pfs->dedupSaved += ent->deflatedLen;
+            }
+            else
+            {
+                layout->offsets[i] = p;
+                p += ent->deflatedLen;
+            }
+        }
+        
+        fent->crc = ent->crc;
+        fent->offset = layout->offsets[i];
+        fent->inflatedLen = ent->inflatedLen;
+    }
+    
+    pfs_free(dedup.slots);
+    pfs_free(dedup.hashes);
+    dedup.slots = NULL;
+    dedup.hashes = NULL;
+    
+    /* Readers pair names with entries in offset order, CRC among entries sharing data; appends don't follow entry order */
+    order = (uint32_t*)pfs_malloc(sizeof(uint32_t) * 3 * c);
+    nameData = (uint8_t*)pfs_malloc(n);
+    
+    if (!order || !nameData)
+    {
+        pfs_free_if_exists(order);
+        pfs_free_if_exists(nameData);
+        rc = PFS_OUT_OF_MEMORY;
+        goto abort;
+    }
+    
+    for (i = 0; i < c; i++)
+    {
+        order[i * 3] = layout->offsets[i];
+        order[i * 3 + 1] = pfs->entries[i].crc;
+        order[i * 3 + 2] = i;
+    }
+    
+    qsort(order, c, sizeof(uint32_t) * 3, pfs_sort_offset_crc);
+    
+    memcpy(nameData, &c, sizeof(c));
+    n = sizeof(uint32_t);
+    
+    for (i = 0; i < c; i++)
+    {
+        const char* name = pfs->entries[order[i * 3 + 2]].name;
+        
+        len = strlen(name) + 1;
+        memcpy(nameData + n, &len, sizeof(len));
+        memcpy(nameData + n + sizeof(len), name, len);
+        n += sizeof(len) + len;
+    }
+    
+    pfs_free(order);
+    
+    /* Names entry */
+    fileEntries[c].crc = 0x61580ac9; /* Always this */
+    fileEntries[c].offset = p;
+    fileEntries[c].inflatedLen = n;
+    
+    qsort(fileEntries, c + 1, sizeof(PfsFileEntry), pfs_sort_by_crc);
+    
+    rc = pfs_compress(pfs, &layout->names, &pfs->deflater, nameData, n, pfs->level, pfs->blockSize, NULL);
+    pfs_free(nameData);
+    if (rc) goto abort;
+    
+    layout->dirOffset = p + layout->names.deflatedLen;
+    layout->end = layout->dirOffset + sizeof(uint32_t) + sizeof(PfsFileEntry) * (c + 1);
+    
+    return PFS_OK;
+    
+abort:
+    pfs_free_if_exists(dedup.slots);
+    pfs_free_if_exists(dedup.hashes);
+    pfs_layout_free(layout);
+    return rc;
+}
+
+/*
+** Streams a laid out archive to a sink in file order: header, new compressed entries, compressed names, directory.
+** Entry data goes straight from wherever it lives. For an append, the sink must already be positioned at layout->start.
+*/
+static int pfs_write_impl(PFS* pfs, PfsLayout* layout, PfsWriteFn write, void* userdata)
+{
+    PfsHeader header;
+    uint32_t p, n, i;
+    
+    memcpy(&header.signature, "PFS ", sizeof(header.signature));
+    header.unknown = 131072; /* Always this */
+    header.offset = layout->dirOffset;
+    
+    /* Header */
+    if (layout->start == sizeof(PfsHeader) && write(userdata, &header, sizeof(header)))
+        return PFS_FILE_ERROR;
+    
+    /* Compressed entries, those placed at the end in order; duplicates and entries kept in place fall behind p */
+    p = layout->start;
+    n = pfs->count;
+    
+    for (i = 0; i < n; i++)
+    {
+        PfsEntry* ent = &pfs->entries[i];
+        
+        if (layout->offsets[i] != p)
+            continue;
+        
+        if (write(userdata, pfs_entry_source(pfs, ent), ent->deflatedLen))
+            return PFS_FILE_ERROR;
+        
+        p += ent->deflatedLen;
+    }
+    
+    /* Compressed names entry */
+    if (write(userdata, layout->names.inserted, layout->names.deflatedLen))
+        return PFS_FILE_ERROR;
+    
+    /* Offset and CRC list in order of CRC */
+    n++;
+    if (write(userdata, &n, sizeof(n)))
+        return PFS_FILE_ERROR;
+    
+    if (write(userdata, layout->fileEntries, sizeof(PfsFileEntry) * n))
+        return PFS_FILE_ERROR;
+    
+    return PFS_OK;
+}
+
+/* Records a layout that has been safely written as the new backing file */
+static void pfs_layout_commit(PFS* pfs, PfsLayout* layout)
+{
+    uint32_t n = pfs->count;
+    uint32_t i;
+    
+    for (i = 0; i < n; i++)
+    {
+        pfs->cold[i].fileOffset = layout->offsets[i];
+    }
+    
+    n++;
+    pfs->unsaved = 0;
+    pfs->fileLength = layout->end;
+    pfs->fileDirOffset = layout->dirOffset;
+    pfs->fileDirSize = sizeof(uint32_t) + sizeof(PfsFileEntry) * n;
+    pfs->fileNamesLen = layout->names.deflatedLen;
+    
+    /* Same bytes as the directory on disk: the count, then the table */
+    pfs->fileDirCrc = pfs_crc_update(pfs_crc(&n, sizeof(n)), layout->fileEntries, sizeof(PfsFileEntry) * n);
+}
+
+static int pfs_write_file_sink(void* userdata, const void* data, uint32_t length)
+{
+    return fwrite(data, sizeof(uint8_t), length, (FILE*)userdata) != length;
+}
+
+static int pfs_write_memory_sink(void* userdata, const void* data, uint32_t length)
+{
+    PfsMemorySink* sink = (PfsMemorySink*)userdata;
+    
+    if (sink->length <= sink->capacity && length <= sink->capacity - sink->length)
+        memcpy(sink->data + sink->length, data, length);
+    
+    sink->length += length;
+    return 0;
+}
+
+#define PFS_WRITE_BUFFER_SIZE (1024 * 1024)
+
+static int pfs_file_sync(FILE* fp)
+{
+    if (fflush(fp) != 0)
+        return PFS_FILE_ERROR;
+    
+#ifndef _WIN32
+    if (fsync(fileno(fp)) != 0)
+        return PFS_FILE_ERROR;
+#endif
+    
+    return PFS_OK;
+}
+
+/*
+** Creates a file beside path for writing that no other writer can have open, and returns its name in *tmp for the
+** caller to rename over path or remove, then free. Its mode is that of the file at path, so the rename keeps it, or
+** the umask's as with fopen() if there is none yet. mkstemp() would make every new archive private to its owner.
+*/
+static FILE* pfs_temp_open(const char* path, char** tmp)
+{
+    size_t len = strlen(path);
+    FILE* fp = NULL;
+    char* name;
+#ifndef _WIN32
+    struct stat st;
+    int keepMode;
+    int attempt;
+    int fd = -1;
+#endif
+    
+    name = (char*)pfs_malloc(len + 48);
+    *tmp = name;
+    if (!name) return NULL;
+    
+    memcpy(name, path, len);
+    
+#ifdef _WIN32
+    memcpy(name + len, ".tmp", 5);
+    fp = fopen(name, "wb");
+#else
+    keepMode = (stat(path, &st) == 0 && S_ISREG(st.st_mode));
+    
+    /* The stack address tells apart threads of one process, the clock successive calls; O_EXCL settles the rest */
+    for (attempt = 0; attempt < 100 && fd < 0; attempt++)
+    {
+        unsigned long salt = (unsigned long)((size_t)&st ^ (size_t)clock()) + (unsigned long)attempt;
+        
+        sprintf(name + len, ".%lu.%lx.tmp", (unsigned long)getpid(), salt);
+        fd = open(name, O_WRONLY | O_CREAT | O_EXCL, 0666);
+        
+        if (fd < 0 && errno != EEXIST)
+            break;
+    }
+    
+    if (fd < 0)
+        return NULL;
+    
+    if (!keepMode || fchmod(fd, st.st_mode & 07777) == 0)
+        fp = fdopen(fd, "wb");
+    
+    if (!fp)
+    {
+        close(fd);
+        remove(name);
+    }
+#endif
+    
+    return fp;
+}
+
+/* Writes to a temporary file beside the target and renames it over the target once complete */
+static int pfs_write_to_disk_impl(PFS* pfs, const char* path)
+{
+    PfsLayout layout;
+    FILE* fp;
+    char* tmp = NULL;
+    uint64_t start;
+    int rc;
+    
+    if (!pfs || !path || *path == 0)
+        return PFS_MISUSE;
+    
+    rc = pfs_layout(pfs, &layout, 0);
+    if (rc) return rc;
+    
+    start = pfs_stat_begin();
+    fp = pfs_temp_open(path, &tmp);
+    
+    if (!fp)
+    {
+        rc = tmp ? PFS_FILE_ERROR : PFS_OUT_OF_MEMORY;
+        goto abort;
+    }
+    
+    setvbuf(fp, NULL, _IOFBF, PFS_WRITE_BUFFER_SIZE);
+    
+    rc = pfs_write_impl(pfs, &layout, pfs_write_file_sink, fp);
+    
+    if (rc == PFS_OK)
+        rc = pfs_file_sync(fp);
+    
+    if (fclose(fp) != 0 && rc == PFS_OK)
+        rc = PFS_FILE_ERROR;
+    
+    if (rc == PFS_OK)
+    {
+#ifdef _WIN32
+        /* rename() won't replace an existing file here */
+        remove(path);
+#endif
+        if (rename(tmp, path) != 0)
+            rc = PFS_FILE_ERROR;
+    }
+    
+    pfs_stat_time(pfs, ioNs, start);
+    
+    if (rc == PFS_OK)
+    {
+        pfs_stat_add(pfs, bytesWritten, layout.end);
+        pfs_layout_commit(pfs, &layout);
+    }
+    else
+    {
+        remove(tmp);
+    }
+    
+abort:
+    pfs_free_if_exists(tmp);
+    pfs_layout_free(&layout);
+    return rc;
+}
+
+int pfs_write_to_disk(PFS* pfs, const char* path)
+{
+    uint64_t start = pfs_trace_begin();
+    int rc = pfs_write_to_disk_impl(pfs, path);
+    
+    pfs_trace_end(PFS_TRACE_WRITE, path, (rc == PFS_OK) ? pfs->fileLength : 0, start, rc);
+    return rc;
+}
+
+/* Checks that path still holds exactly the archive this handle last loaded or saved */
+static int pfs_file_matches(PFS* pfs, FILE* fp)
+{
+    PfsHeader header;
+    uint8_t* dir;
+    int match = 0;
+    
+    if (fseek(fp, 0, SEEK_END) != 0 || (uint32_t)ftell(fp) != pfs->fileLength || fseek(fp, 0, SEEK_SET) != 0)
+        return 0;
+    
+    if (fread(&header, sizeof(header), 1, fp) != 1 || header.offset != pfs->fileDirOffset)
+        return 0;
+    
+    dir = (uint8_t*)pfs_malloc(pfs->fileDirSize);
+    if (!dir) return 0;
+    
+    if (fseek(fp, header.offset, SEEK_SET) == 0 && fread(dir, pfs->fileDirSize, 1, fp) == 1)
+        match = (pfs_crc(dir, pfs->fileDirSize) == pfs->fileDirCrc);
+    
+    pfs_free(dir);
+    return match;
+}
+
+/*
+** Appends new and changed entries, the name data entry and the directory to the end of the archive, then points the
+** header at the new directory. The old directory stays intact until that last 12 byte write, so a failure part way
+** leaves the previous archive readable. Dead space accumulates; see pfs_compact().
+*/
+static int pfs_save_incremental_impl(PFS* pfs, const char* path)
+{
+    PfsLayout layout;
+    PfsHeader header;
+    FILE* fp;
+    uint64_t start;
+    int rc;
+    
+    if (!pfs || !path || *path == 0)
+        return PFS_MISUSE;
+    
+    if (pfs->readOnly)
+        return PFS_READ_ONLY;
+    
+    rc = pfs_require_names(pfs);
+    if (rc) return rc;
+    
+    if (pfs->fileLength == 0)
+        return pfs_write_to_disk_impl(pfs, path);
+    
+    fp = fopen(path, "r+b");
+    
+    if (!fp || !pfs_file_matches(pfs, fp))
+    {
+        if (fp) fclose(fp);
+        return pfs_write_to_disk_impl(pfs, path);
+    }
+    
+    /* Already what is on disk: appending would only add another copy of the names and directory */
+    if (!pfs->unsaved)
+    {
+        fclose(fp);
+        return PFS_OK;
+    }
+    
+    rc = pfs_layout(pfs, &layout, 1);
+    if (rc) goto close_file;
+    
+    start = pfs_stat_begin();
+    rc = PFS_FILE_ERROR;
+    
+    if (fseek(fp, layout.start, SEEK_SET) != 0)
+        goto abort;
+    
+    rc = pfs_write_impl(pfs, &layout, pfs_write_file_sink, fp);
+    if (rc) goto abort;
+    
+    /* Everything the new header refers to must be on disk before the header itself */
+    rc = pfs_file_sync(fp);
+    if (rc) goto abort;
+    
+    memcpy(&header.signature, "PFS ", sizeof(header.signature));
+    header.unknown = 131072; /* Always this */
+    header.offset = layout.dirOffset;
+    
+    rc = PFS_FILE_ERROR;
+    
+    if (fseek(fp, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, fp) != 1)
+        goto abort;
+    
+    rc = pfs_file_sync(fp);
+    pfs_stat_time(pfs, ioNs, start);
+    
+    if (rc == PFS_OK)
+    {
+        pfs_stat_add(pfs, bytesWritten, layout.end - layout.start + sizeof(header));
+        pfs_layout_commit(pfs, &layout);
+    }
+    
+abort:
+    pfs_layout_free(&layout);
+close_file:
+    if (fclose(fp) != 0 && rc == PFS_OK)
+        rc = PFS_FILE_ERROR;
+    
+    return rc;
+}
+
+int pfs_save_incremental(PFS* pfs, const char* path)
+{
+    uint64_t start = pfs_trace_begin();
+    int rc = pfs_save_incremental_impl(pfs, path);
+    
+    pfs_trace_end(PFS_TRACE_WRITE, path, (rc == PFS_OK) ? pfs->fileLength : 0, start, rc);
+    return rc;
+}
+
+uint32_t pfs_deduplicated_bytes(PFS* pfs)
+{
+    return (pfs) ? pfs->dedupSaved : 0;
+}
+
+uint32_t pfs_wasted_bytes(PFS* pfs)
+{
+    uint32_t* offsets;
+    uint32_t live, n, i, k;
+    
+    if (!pfs || pfs->fileLength == 0 || pfs_require_names(pfs))
+        return 0;
+    
+    n = pfs->count;
+    offsets = (uint32_t*)pfs_malloc(sizeof(uint32_t) * 2 * (n + 1));
+    if (!offsets) return 0;
+    
+    /* Pair each offset with its length so entries sharing data are only counted once */
+    k = 0;
+    
+    for (i = 0; i < n; i++)
+    {
+        PfsEntry* ent = &pfs->entries[i];
+        uint32_t fileOffset = pfs->cold[i].fileOffset;
+        
+        if (fileOffset == PFS_OFFSET_NONE || pfs_entry_resolve(pfs, ent))
+            continue;
+        
+        offsets[k * 2] = fileOffset;
+        offsets[k * 2 + 1] = ent->deflatedLen;
+        k++;
+    }
+    
+    qsort(offsets, k, sizeof(uint32_t) * 2, pfs_sort_uint32);
+    
+    live = sizeof(PfsHeader) + pfs->fileNamesLen + pfs->fileDirSize;
+    
+    for (i = 0; i < k; i++)
+    {
+        if (i == 0 || offsets[i * 2] != offsets[(i - 1) * 2])
+            live += offsets[i * 2 + 1];
+    }
+    
+    pfs_free(offsets);
+    return (live < pfs->fileLength) ? pfs->fileLength - live : 0;
+}
+
+int pfs_compact(PFS* pfs, const char* path, uint32_t maxWastePercent)
+{
+    uint64_t wasted;
+    
+    if (!pfs || !path || *path == 0)
+        return PFS_MISUSE;
+    
+    if (pfs->readOnly)
+        return PFS_READ_ONLY;
+    
+    wasted = pfs_wasted_bytes(pfs);
+    
+    /* Below the threshold the changes still have to reach the disk, just appended */
+    if (wasted * 100 <= (uint64_t)maxWastePercent * pfs->fileLength)
+        return pfs_save_incremental(pfs, path);
+    
+    return pfs_write_to_disk(pfs, path);
+}
+
+static int pfs_write_to_memory_impl(PFS* pfs, void* buf, uint32_t capacity, uint32_t* length)
+{
+    PfsMemorySink sink;
+    PfsLayout layout;
+    int rc;
+    
+    if (!pfs || !length || (!buf && capacity))
+        return PFS_MISUSE;
+    
+    rc = pfs_layout(pfs, &layout, 0);
+    if (rc) return rc;
+    
+    sink.data = (uint8_t*)buf;
+    sink.capacity = capacity;
+    sink.length = 0;
+    
+    rc = pfs_write_impl(pfs, &layout, pfs_write_memory_sink, &sink);
+    pfs_layout_free(&layout);
+    if (rc) return rc;
+    
+    *length = sink.length;
+    return (sink.length > capacity) ? PFS_OUT_OF_BOUNDS : PFS_OK;
+}
+
+int pfs_write_to_memory(PFS* pfs, void* buf, uint32_t capacity, uint32_t* length)
+{
+    uint64_t start = pfs_trace_begin();
+    int rc = pfs_write_to_memory_impl(pfs, buf, capacity, length);
+    
+    pfs_trace_end(PFS_TRACE_WRITE, NULL, (rc == PFS_OK) ? *length : 0, start, rc);
+    return rc;
+}
+
+/* A full layout starts at the header, so everything handed to write comes to its end */
+static int pfs_write_to_callback_impl(PFS* pfs, PfsWriteFn write, void* userdata, uint32_t* length)
+{
+    PfsLayout layout;
+    int rc;
+    
+    if (!pfs || !write)
+        return PFS_MISUSE;
+    
+    rc = pfs_layout(pfs, &layout, 0);
+    if (rc) return rc;
+    
+    rc = pfs_write_impl(pfs, &layout, write, userdata);
+    
+    if (rc == PFS_OK)
+        *length = layout.end;
+    
+    pfs_layout_free(&layout);
+    return rc;
+}
+
+int pfs_write_to_callback(PFS* pfs, PfsWriteFn write, void* userdata)
+{
+    uint64_t start = pfs_trace_begin();
+    uint32_t length = 0;
+    int rc = pfs_write_to_callback_impl(pfs, write, userdata, &length);
+    
+    pfs_trace_end(PFS_TRACE_WRITE, NULL, length, start, rc);
+    return rc;
+}
+
+static int pfs_file_index_by_hash(PFS* pfs, const char* name)
+{
+    uint32_t* slots = pfs->slots;
+    uint32_t crc, mask, i, s;
+    uint32_t probes = 1;
+    
+    if (!slots) return PFS_NOT_FOUND;
+    
+    crc = pfs_crc(name, strlen(name) + 1); /* CRC includes the null terminator */
+    mask = pfs->slotCount - 1;
+    i = crc & mask;
+    
+    while ((s = slots[i]) != 0)
+    {
+        s--;
+        
+        if (pfs->entries[s].crc == crc && strcmp(pfs->entries[s].name, name) == 0)
+        {
+            pfs_stat_add_local(pfs, probes, probes);
+            return (int)s;
+        }
+        
+        i = (i + 1) & mask;
+        probes++;
+    }
+    
+    pfs_stat_add_local(pfs, probes, probes);
+    return PFS_NOT_FOUND;
+}
+
+/*
+** Binary searches the on-disk directory, which is sorted by CRC, without inflating any names.
+** A CRC match is trusted unless several entries share that CRC, in which case the names are loaded.
+*/
+static int pfs_file_index_by_crc(PFS* pfs, const char* name)
+{
+    const PfsFileEntry* dir = (const PfsFileEntry*)(pfs->data + pfs->dirOffset);
+    PfsEntry* entries = pfs->entries;
+    uint32_t crc = pfs_crc(name, strlen(name) + 1); /* CRC includes the null terminator */
+    uint32_t n = pfs->dirCount;
+    uint32_t lo = 0;
+    uint32_t hi = n;
+    uint32_t offset;
+    
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        
+        if (dir[mid].crc < crc)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    
+    if (lo == n || dir[lo].crc != crc)
+        return PFS_NOT_FOUND;
+    
+    if (lo + 1 < n && dir[lo + 1].crc == crc)
+    {
+        int rc = pfs_require_names(pfs);
+        return (rc) ? rc : pfs_file_index_by_hash(pfs, name);
+    }
+    
+    /* Entries are still in the order pfs_open_impl sorted them, by offset */
+    offset = dir[lo].offset;
+    n = pfs->count;
+    lo = 0;
+    hi = n;
+    
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        
+        if (entries[mid].offset < offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    
+    /* Deduplicated entries share an offset; pfs_open_impl orders those by CRC */
+    while (lo < n && entries[lo].offset == offset)
+    {
+        if (entries[lo].crc == crc)
+            return (int)lo;
+        
+        lo++;
+    }
+    
+    return PFS_NOT_FOUND;
+}
+
+static int pfs_file_index_by_name(PFS* pfs, const char* name)
+{
+    int index;
+    
+    if (!pfs || !name)
+        return PFS_MISUSE;
+    
+    index = (pfs_atomic_load(&pfs->namesPending)) ? pfs_file_index_by_crc(pfs, name) : pfs_file_index_by_hash(pfs, name);
+    
+    pfs_stat_add_local(pfs, lookups, 1);
+    
+    if (index < 0)
+        pfs_stat_add_local(pfs, lookupMisses, 1);
+    
+    return index;
+}
+
+static PfsEntry* pfs_get_entry(PFS* pfs, const char* name)
+{
+    int index = pfs_file_index_by_name(pfs, name);
+    return (index >= 0) ? &pfs->entries[index] : NULL;
+}
+
+static PfsEntry* pfs_get_or_append_entry(PFS* pfs, const char* name)
+{
+    int index = pfs_file_index_by_name(pfs, name);
+    PfsEntry* ent;
+    PfsEntryCold* cold;
+    int namelen;
+    
+    /* Every caller goes on to change the entry */
+    pfs->unsaved = 1;
+    
+    if (index >= 0)
+        return &pfs->entries[index];
+    
+    index = (int)pfs->count;
+    
+    if (pfs_is_pow2_or_zero(index))
+    {
+        int cap = (index == 0) ? 1 : index * 2;
+        PfsEntry* entries;
+        PfsEntryCold* cold;
+        
+        entries = (PfsEntry*)pfs_realloc(pfs->entries, sizeof(PfsEntry) * cap);
+        if (!entries) return NULL;
+        pfs->entries = entries;
+        
+        cold = (PfsEntryCold*)pfs_realloc(pfs->cold, sizeof(PfsEntryCold) * cap);
+        if (!cold) return NULL;
+        pfs->cold = cold;
+    }
+    
+    if ((uint32_t)(index + 1) * 2 > pfs->slotCount && pfs_index_rebuild(pfs, index + 1))
+        return NULL;
+    
+    namelen = strlen(name);
+    
+    ent = &pfs->entries[index];
+    ent->name = pfs_arena_alloc(pfs, (uint32_t)namelen + 1);
+    if (!ent->name) return NULL;
+    memcpy(ent->name, name, namelen);
+    ent->name[namelen] = 0;
+    
+    ent->crc = pfs_crc(name, namelen + 1); /* CRC includes the null terminator */
+    ent->offset = 0;
+    ent->inflatedLen = 0;
+    ent->deflatedLen = 0;
+    ent->inserted = NULL;
+    
+    cold = &pfs->cold[index];
+    cold->fileOffset = PFS_OFFSET_NONE;
+    cold->insertedIsCopy = 0;
+    cold->level = PFS_LEVEL_DEFAULT;
+    
+    pfs_index_insert(pfs, (uint32_t)index);
+    pfs->count = index + 1;
+    
+    return ent;
+}
+
+/* Points at the extension of the last path component, or at the terminator if there is none */
+static const char* pfs_extension(const char* name)
+{
+    const char* ext = NULL;
+    const char* p;
+    
+    for (p = name; *p; p++)
+    {
+        if (*p == '.')
+            ext = p + 1;
+        else if (*p == '/' || *p == '\\')
+            ext = NULL;
+    }
+    
+    return (ext) ? ext : p;
+}
+
+static int pfs_extension_equal(const char* a, const char* b)
+{
+    while (*a && tolower((uint8_t)*a) == tolower((uint8_t)*b))
+    {
+        a++;
+        b++;
+    }
+    
+    return *a == *b;
+}
+
+static PfsExtLevel* pfs_find_extension(PFS* pfs, const char* ext)
+{
+    uint32_t i;
+    
+    for (i = 0; i < pfs->extLevelCount; i++)
+    {
+        if (pfs_extension_equal(pfs->extLevels[i].ext, ext))
+            return &pfs->extLevels[i];
+    }
+    
+    return NULL;
+}
+
+static int pfs_level_for_name(PFS* pfs, const char* name)
+{
+    PfsExtLevel* el = (pfs->extLevelCount) ? pfs_find_extension(pfs, pfs_extension(name)) : NULL;
+    
+    return (el) ? el->level : pfs->level;
+}
+
+int pfs_set_extension_level(PFS* pfs, const char* ext, int level)
+{
+    PfsExtLevel* el;
+    
+    if (!pfs || !ext)
+        return PFS_MISUSE;
+    
+    if (*ext == '.')
+        ext++;
+    
+    if (*ext == 0 || strlen(ext) >= PFS_EXT_MAX || (level != PFS_LEVEL_DEFAULT && !pfs_level_is_valid(level)))
+        return PFS_MISUSE;
+    
+    el = pfs_find_extension(pfs, ext);
+    
+    if (level == PFS_LEVEL_DEFAULT)
+    {
+        /* Removing: the last override takes its place */
+        if (el)
+            *el = pfs->extLevels[--pfs->extLevelCount];
+        
+        return PFS_OK;
+    }
+    
+    if (!el)
+    {
+        el = (PfsExtLevel*)pfs_realloc(pfs->extLevels, sizeof(PfsExtLevel) * (pfs->extLevelCount + 1));
+        if (!el) return PFS_OUT_OF_MEMORY;
+        
+        pfs->extLevels = el;
+        el += pfs->extLevelCount++;
+        strcpy(el->ext, ext);
+    }
+    
+    el->level = level;
+    return PFS_OK;
+}
+
+int pfs_file_compression_level(PFS* pfs, const char* name, int* level)
+{
+    int index;
+    
+    if (!pfs || !name || !level)
+        return PFS_MISUSE;
+    
+    index = pfs_file_index_by_name(pfs, name);
+    if (index < 0) return index;
+    
+    *level = pfs->cold[index].level;
+    return PFS_OK;
+}
+
+int pfs_insert_file(PFS* pfs, const char* name, const void* data, uint32_t length)
+{
+    return pfs_insert_file_ex(pfs, name, data, length, PFS_LEVEL_DEFAULT, 0);
+}
+
+static int pfs_insert_file_ex_impl(PFS* pfs, const char* name, const void* data, uint32_t length, int level, uint32_t blockSize)
+{
+    PfsEntry res;
+    PfsEntry* ent;
+    PfsEntryCold* cold;
+    int rc;
+    
+    if (!pfs || !name || *name == 0 || !data || !length)
+        return PFS_MISUSE;
+    
+    if (pfs->readOnly)
+        return PFS_READ_ONLY;
+    
+    if (level == PFS_LEVEL_DEFAULT)
+        level = pfs_level_for_name(pfs, name);
+    
+    if (blockSize == 0)
+        blockSize = pfs->blockSize;
+    
+    if (!pfs_level_is_valid(level) || blockSize < PFS_BLOCK_SIZE_MIN || blockSize > PFS_BLOCK_SIZE_MAX)
+        return PFS_MISUSE;
+    
+    rc = pfs_require_names(pfs);
+    if (rc) return rc;
+    
+    /* Compressed aside first, so a failure leaves the archive as it was */
+    rc = pfs_compress(pfs, &res, &pfs->deflater, data, length, level, blockSize, &level);
+    if (rc) return rc;
+    
+    ent = pfs_get_or_append_entry(pfs, name);
+    
+    if (!ent)
+    {
+        pfs_free(res.inserted);
+        return PFS_OUT_OF_MEMORY;
+    }
+    
+    pfs_cache_drop(pfs, ent);
+    cold = pfs_cold(pfs, ent);
+    
+    if (ent->inserted && cold->insertedIsCopy)
+        pfs_free(ent->inserted);
+    
+    cold->insertedIsCopy = 1;
+    cold->fileOffset = PFS_OFFSET_NONE;
+    cold->level = (int8_t)level;
+    ent->inserted = res.inserted;
+    ent->inflatedLen = res.inflatedLen;
+    ent->deflatedLen = res.deflatedLen;
+    return PFS_OK;
+}
+
+int pfs_insert_file_ex(PFS* pfs, const char* name, const void* data, uint32_t length, int level, uint32_t blockSize)
+{
+    uint64_t start = pfs_trace_begin();
+    int rc = pfs_insert_file_ex_impl(pfs, name, data, length, level, blockSize);
+    
+    pfs_trace_end(PFS_TRACE_INSERT, name, (rc == PFS_OK) ? length : 0, start, rc);
+    return rc;
+}
+
+/* Checks that a caller-built block chain covers exactly length bytes and totals its inflated size */
+static int pfs_validate_blocks(const uint8_t* src, uint32_t length, uint32_t* outInflatedLen)
+{
+    uint32_t pos = 0;
+    uint32_t total = 0;
+    
+    while (pos < length)
+    {
+        PfsBlock block;
+        const uint8_t* z;
+        
+        if (length - pos < sizeof(PfsBlock))
+            return PFS_CORRUPTED;
+        
+        memcpy(&block, src + pos, sizeof(block));
+        pos += sizeof(PfsBlock);
+        
+        if (block.deflatedLen < 2 || block.deflatedLen > length - pos)
+            return PFS_CORRUPTED;
+        
+        if (block.inflatedLen == 0 || block.inflatedLen > 0xffffffff - total)
+            return PFS_CORRUPTED;
+        
+        /* Each block is a zlib stream of its own: deflate method, header check bits */
+        z = src + pos;
+        
+        if ((z[0] & 0x0f) != 8 || ((z[0] << 8) | z[1]) % 31 != 0)
+            return PFS_CORRUPTED;
+        
+        pos += block.deflatedLen;
+        total += block.inflatedLen;
+    }
+    
+    *outInflatedLen = total;
+    return PFS_OK;
+}
+
+static int pfs_insert_compressed_impl(PFS* pfs, const char* name, const void* data, uint32_t length)
+{
+    PfsEntry* ent;
+    PfsEntryCold* cold;
+    uint8_t* copy;
+    uint32_t inflatedLen;
+    int rc;
+    
+    if (!pfs || !name || *name == 0 || !data || !length)
+        return PFS_MISUSE;
+    
+    if (pfs->readOnly)
+        return PFS_READ_ONLY;
+    
+    rc = pfs_validate_blocks((const uint8_t*)data, length, &inflatedLen);
+    if (rc) return rc;
+    
+    rc = pfs_require_names(pfs);
+    if (rc) return rc;
+    
+    copy = (uint8_t*)pfs_malloc(length);
+    if (!copy) return PFS_OUT_OF_MEMORY;
+    
+    pfs_stat_alloc(pfs, length);
+    memcpy(copy, data, length);
+    
+    ent = pfs_get_or_append_entry(pfs, name);
+    
+    if (!ent)
+    {
+        pfs_free(copy);
+        return PFS_OUT_OF_MEMORY;
+    }
+    
+    pfs_cache_drop(pfs, ent);
+    cold = pfs_cold(pfs, ent);
+    
+    if (ent->inserted && cold->insertedIsCopy)
+        pfs_free(ent->inserted);
+    
+    cold->insertedIsCopy = 1;
+    cold->fileOffset = PFS_OFFSET_NONE;
+    cold->level = PFS_LEVEL_DEFAULT;
+    ent->inserted = copy;
+    ent->inflatedLen = inflatedLen;
+    ent->deflatedLen = length;
+    
+    return PFS_OK;
+}
+
+int pfs_insert_compressed(PFS* pfs, const char* name, const void* data, uint32_t length)
+{
+    uint64_t start = pfs_trace_begin();
+    int rc = pfs_insert_compressed_impl(pfs, name, data, length);
+    
+    pfs_trace_end(PFS_TRACE_INSERT, name, (rc == PFS_OK) ? length : 0, start, rc);
+    return rc;
+}
+
+int pfs_compress_data(PFS* pfs, const void* data, uint32_t length, int level, uint32_t blockSize, uint8_t** outData, uint32_t* outLength)
+{
+    PfsEntry ent;
+    int rc;
+    
+    if (!pfs || !data || !length || !outData || !outLength)
+        return PFS_MISUSE;
+    
+    if (level == PFS_LEVEL_DEFAULT)
+        level = pfs->level;
+    
+    if (blockSize == 0)
+        blockSize = pfs->blockSize;
+    
+    if (!pfs_level_is_valid(level) || blockSize < PFS_BLOCK_SIZE_MIN || blockSize > PFS_BLOCK_SIZE_MAX)
+        return PFS_MISUSE;
+    
+    rc = pfs_compress(pfs, &ent, &pfs->deflater, data, length, level, blockSize, NULL);
+    if (rc) return rc;
+    
+    *outData = ent.inserted;
+    *outLength = ent.deflatedLen;
+    return PFS_OK;
+}
+
+typedef struct {
+    PFS*                pfs;
+    const void* const*  datas;
+    const uint32_t*     lengths;
+    int*                levels;     /* In: requested, out: what the entry reports */
+    PfsEntry*           results;
+    PfsDeflater*        deflaters;
+    int*                rcs;
+    uint64_t*           ns;         /* Compression time, for the trace callback */
+} PfsInsertBatch;
+
+static void pfs_insert_files_job(void* arg, uint32_t worker, uint32_t item)
+{
+    PfsInsertBatch* batch = (PfsInsertBatch*)arg;
+    PFS* pfs = batch->pfs;
+    uint64_t start = pfs_trace_begin();
+    
+    batch->rcs[item] = pfs_compress(pfs, &batch->results[item], &batch->deflaters[worker], batch->datas[item], batch->lengths[item], batch->levels[item], pfs->blockSize, &batch->levels[item]);
+    batch->ns[item] = pfs_trace_elapsed(start);
+}
+
+int pfs_insert_files(PFS* pfs, const char* const* names, const void* const* datas, const uint32_t* lengths, uint32_t count, uint32_t nthreads)
+{
+    PfsInsertBatch batch;
+    int* levels;
+    uint32_t i;
+    int rc;
+    
+    if (!pfs || !names || !datas || !lengths)
+        return PFS_MISUSE;
+    
+    if (pfs->readOnly)
+        return PFS_READ_ONLY;
+    
+    for (i = 0; i < count; i++)
+    {
+        if (!names[i] || *names[i] == 0 || !datas[i] || !lengths[i])
+            return PFS_MISUSE;
+    }
+    
+    if (count == 0)
+        return PFS_OK;
+    
+    rc = pfs_require_names(pfs);
+    if (rc) return rc;
+    
+    nthreads = pfs_thread_count(nthreads, count);
+    
+    batch.pfs = pfs;
+    batch.datas = datas;
+    batch.lengths = lengths;
+    batch.levels = levels = (int*)pfs_malloc(sizeof(int) * count);
+    batch.results = (PfsEntry*)pfs_calloc(count, sizeof(PfsEntry));
+    batch.deflaters = (PfsDeflater*)pfs_calloc(nthreads, sizeof(PfsDeflater));
+    batch.rcs = (int*)pfs_calloc(count, sizeof(int));
+    batch.ns = (uint64_t*)pfs_calloc(count, sizeof(uint64_t));
+    
+    rc = PFS_OUT_OF_MEMORY;
+    
+    if (!levels || !batch.results || !batch.deflaters || !batch.rcs || !batch.ns)
+        goto abort;
+    
+    for (i = 0; i < count; i++)
+    {
+        levels[i] = pfs_level_for_name(pfs, names[i]);
+    }
+    
+    /* Compression is independent per entry; only the registration below touches the handle */
+    pfs_parallel_for(nthreads, count, pfs_insert_files_job, &batch);
+    
+    rc = PFS_OK;
+    
+    /* Register in order, as though pfs_insert_file() had been called for each, stopping at the first failure */
+    for (i = 0; i < count; i++)
+    {
+        PfsEntry* res = &batch.results[i];
+        PfsEntry* ent;
+        PfsEntryCold* cold;
+        
+        rc = batch.rcs[i];
+        ent = rc ? NULL : pfs_get_or_append_entry(pfs, names[i]);
+        
+        if (!ent)
+        {
+            if (!rc) rc = PFS_OUT_OF_MEMORY;
+            pfs_trace_emit(PFS_TRACE_INSERT, names[i], 0, batch.ns[i], rc);
+            break;
+        }
+        
+        pfs_cache_drop(pfs, ent);
+        cold = pfs_cold(pfs, ent);
+        
+        if (ent->inserted && cold->insertedIsCopy)
+            pfs_free(ent->inserted);
+        
+        cold->insertedIsCopy = 1;
+        cold->fileOffset = PFS_OFFSET_NONE;
+        cold->level = (int8_t)levels[i];
+        ent->inserted = res->inserted;
+        ent->inflatedLen = res->inflatedLen;
+        ent->deflatedLen = res->deflatedLen;
+        res->inserted = NULL;
+        
+        pfs_trace_emit(PFS_TRACE_INSERT, names[i], lengths[i], batch.ns[i], PFS_OK);
+    }
+    
+    for (; i < count; i++)
+    {
+        pfs_free_if_exists(batch.results[i].inserted);
+    }
+    
+abort:
+    if (batch.deflaters)
+    {
+        for (i = 0; i < nthreads; i++)
+        {
+            pfs_deflater_release(&batch.deflaters[i]);
+        }
+    }
+    
+    pfs_free_if_exists(levels);
+    pfs_free_if_exists(batch.results);
+    pfs_free_if_exists(batch.deflaters);
+    pfs_free_if_exists(batch.rcs);
+    pfs_free_if_exists(batch.ns);
+    
+    return rc;
+}
+
+int pfs_set_compression_level(PFS* pfs, int level)
+{
+    if (!pfs || !pfs_level_is_valid(level))
+        return PFS_MISUSE;
+    
+    pfs->level = level;
+    return PFS_OK;
+}
+
+int pfs_set_block_size(PFS* pfs, uint32_t blockSize)
+{
+    if (!pfs || blockSize < PFS_BLOCK_SIZE_MIN || blockSize > PFS_BLOCK_SIZE_MAX)
+        return PFS_MISUSE;
+    
+    pfs->blockSize = blockSize;
+    return PFS_OK;
+}
+
+static int pfs_dupe_impl(PFS* dst, PFS* src, const char* name, int isCopy)
+{
+    PfsEntry* ent;
+    PfsEntryCold* cold;
+    PfsEntry* srcEnt;
+    uint8_t* data;
+    int rc;
+    
+    if (!dst || !src || !name || *name == 0)
+        return PFS_MISUSE;
+    
+    if (dst->readOnly)
+        return PFS_READ_ONLY;
+    
+    rc = pfs_require_names(dst);
+    if (rc) return rc;
+    
+    srcEnt = pfs_get_entry(src, name);
+    if (!srcEnt) return PFS_NOT_FOUND;
+    
+    /* Onto itself: nothing to do, and the copy below would free its own source */
+    if (dst == src) return PFS_OK;
+    
+    rc = pfs_entry_resolve(src, srcEnt);
+    if (rc) return rc;
+    
+    data = (srcEnt->inserted) ? srcEnt->inserted : (src->data + srcEnt->offset);
+    
+    /* Copied before the entry is touched, so a failure leaves dst as it was */
+    if (isCopy)
+    {
+        uint8_t* copy = (uint8_t*)pfs_malloc(srcEnt->deflatedLen);
+        
+        if (!copy) return PFS_OUT_OF_MEMORY;
+        
+        pfs_stat_alloc(dst, srcEnt->deflatedLen);
+        memcpy(copy, data, srcEnt->deflatedLen);
+        data = copy;
+    }
+    
+    ent = pfs_get_or_append_entry(dst, name);
+    
+    if (!ent)
+    {
+        if (isCopy) pfs_free(data);
+        return PFS_OUT_OF_MEMORY;
+    }
+    
+    pfs_cache_drop(dst, ent);
+    cold = pfs_cold(dst, ent);
+    
+    if (ent->inserted && cold->insertedIsCopy)
+        pfs_free(ent->inserted);
+    
+    cold->insertedIsCopy = (uint8_t)isCopy;
+    cold->level = pfs_cold(src, srcEnt)->level;
+    cold->fileOffset = PFS_OFFSET_NONE;
+    ent->inserted = data;
+    ent->inflatedLen = srcEnt->inflatedLen;
+    ent->deflatedLen = srcEnt->deflatedLen;
+    
+    return PFS_OK;
+}
+
+int pfs_fast_file_duplicate(PFS* dst, PFS* src, const char* name)
+{
+    return pfs_dupe_impl(dst, src, name, 1);
+}
+
+int pfs_fast_file_duplicate_no_copy(PFS* dst, PFS* src, const char* name)
+{
+    return pfs_dupe_impl(dst, src, name, 0);
+}
+
+int pfs_remove_file(PFS* pfs, const char* name)
+{
+    int index;
+    PfsEntry* ent;
+    PfsShared* sh;
+    uint32_t n;
+    
+    if (!pfs || !name)
+        return PFS_MISUSE;
+    
+    if (pfs->readOnly)
+        return PFS_READ_ONLY;
+    
+    index = pfs_require_names(pfs);
+    if (index) return index;
+    
+    index = pfs_file_index_by_name(pfs, name);
+    if (index < 0) return index;
+    
+    ent = &pfs->entries[index];
+    pfs->unsaved = 1;
+    
+    pfs_cache_drop(pfs, ent);
+    
+    /* The name stays in the archive's name data or the arena until close */
+    if (ent->inserted && pfs->cold[index].insertedIsCopy)
+    {
+        pfs_free(ent->inserted);
+    }
+    ent->inserted = NULL;
+    
+    /* Swap and pop */
+    n = pfs->count - 1;
+    pfs->count = n;
+    
+    pfs_index_remove(pfs, (uint32_t)index);
+    
+    if ((uint32_t)index != n)
+        pfs_index_move(pfs, n, (uint32_t)index);
+    
+    pfs->entries[index] = pfs->entries[n];
+    pfs->cold[index] = pfs->cold[n];
+    
+    if ((uint32_t)index != n && (sh = pfs_cache_find(&pfs->cache, n)) != NULL)
+    {
+        pfs_cache_table_remove(&pfs->cache, sh);
+        sh->index = (uint32_t)index;
+        pfs_cache_table_insert(&pfs->cache, sh);
+    }
+    
+    return PFS_OK;
+}
+
+const char* pfs_file_name(PFS* pfs, uint32_t index)
+{
+    const char* name = NULL;
+    
+    if (pfs && pfs_require_names(pfs) == PFS_OK && index < pfs->count)
+        name = pfs->entries[index].name;
+    
+    return name;
+}
+
+uint32_t pfs_file_size(PFS* pfs, uint32_t index)
+{
+    uint32_t size = 0;
+    
+    if (pfs && index < pfs->count)
+        size = pfs->entries[index].inflatedLen;
+    
+    return size;
+}
+
+uint32_t pfs_file_size_by_name(PFS* pfs, const char* name)
+{
+    int index = pfs_file_index_by_name(pfs, name);
+    return (index >= 0) ? pfs->entries[index].inflatedLen : 0;
+}
+
+uint32_t pfs_file_size_compressed(PFS* pfs, uint32_t index)
+{
+    uint32_t size = 0;
+    
+    if (pfs && index < pfs->count && pfs_entry_resolve(pfs, &pfs->entries[index]) == PFS_OK)
+        size = pfs->entries[index].deflatedLen;
+    
+    return size;
+}
+
+int pfs_file_data(PFS* pfs, const char* name, uint8_t** data, uint32_t* length)
+{
+    PfsInflater local;
+    PfsInflater* inf;
+    int rc;
+    
+    if (!pfs) return PFS_MISUSE;
+    
+    inf = pfs_inflater_acquire(pfs, &local);
+    rc = pfs_file_data_with_inflater(pfs, inf, name, data, length);
+    pfs_inflater_return(pfs, inf, &local);
+    
+    return rc;
+}
+
+static int pfs_file_data_with_inflater_impl(PFS* pfs, PfsInflater* inf, const char* name, uint8_t** data, uint32_t* length)
+{
+    int index;
+    
+    if (!pfs || !inf || !name || !data || !length)
+        return PFS_MISUSE;
+    
+    index = pfs_file_index_by_name(pfs, name);
+    if (index < 0) return index;
+    
+    return pfs_decompress_index(pfs, inf, data, length, (uint32_t)index);
+}
+
+int pfs_file_data_with_inflater(PFS* pfs, PfsInflater* inf, const char* name, uint8_t** data, uint32_t* length)
+{
+    uint64_t start = pfs_trace_begin();
+    int rc = pfs_file_data_with_inflater_impl(pfs, inf, name, data, length);
+    
+    pfs_trace_end(PFS_TRACE_READ, name, (rc == PFS_OK) ? *length : 0, start, rc);
+    return rc;
+}
+
+static int pfs_file_data_into_impl(PFS* pfs, const char* name, void* buf, uint32_t capacity, uint32_t* length)
+{
+    PfsInflater local;
+    PfsInflater* inf;
+    PfsEntry* ent;
+    int index;
+    int rc;
+    
+    if (!pfs || !name || !length || (!buf && capacity))
+        return PFS_MISUSE;
+    
+    index = pfs_file_index_by_name(pfs, name);
+    if (index < 0) return index;
+    
+    ent = &pfs->entries[index];
+    
+    rc = pfs_entry_resolve(pfs, ent);
+    if (rc) return rc;
+    
+    *length = ent->inflatedLen;
+    
+    if (capacity < ent->inflatedLen)
+        return PFS_OUT_OF_BOUNDS;
+    
+    inf = pfs_inflater_acquire(pfs, &local);
+    rc = pfs_inflate_entry(pfs, inf, ent, (uint8_t*)buf);
+    pfs_inflater_return(pfs, inf, &local);
+    
+    return rc;
+}
+
+int pfs_file_data_into(PFS* pfs, const char* name, void* buf, uint32_t capacity, uint32_t* length)
+{
+    uint64_t start = pfs_trace_begin();
+    int rc = pfs_file_data_into_impl(pfs, name, buf, capacity, length);
+    
+    pfs_trace_end(PFS_TRACE_READ, name, (rc == PFS_OK) ? *length : 0, start, rc);
+    return rc;
+}
+
+void pfs_file_data_free(void* data)
+{
+    pfs_free_if_exists(data);
+}
+
+static int pfs_file_data_shared_impl(PFS* pfs, const char* name, const uint8_t** data, uint32_t* length)
+{
+    PfsInflater local;
+    PfsInflater* inf;
+    PfsCache* cache;
+    PfsEntry* ent;
+    PfsShared* sh;
+    PfsShared* cached;
+    int index;
+    int rc;
+    
+    if (!pfs || !name || !data || !length)
+        return PFS_MISUSE;
+    
+    index = pfs_file_index_by_name(pfs, name);
+    if (index < 0) return index;
+    
+    cache = &pfs->cache;
+    ent = &pfs->entries[index];
+    
+    /* Read-only handles lock the cache but inflate outside the lock */
+    pfs_lock(pfs);
+    sh = pfs_cache_find(cache, (uint32_t)index);
+    
+    if (sh)
+    {
+        cache->hits++;
+        pfs_cache_unlink(cache, sh);
+        pfs_cache_push_front(cache, sh);
+        goto done;
+    }
+    
+    cache->misses++;
+    pfs_unlock(pfs);
+    
+    rc = pfs_entry_resolve(pfs, ent);
+    if (rc) return rc;
+    
+    sh = (PfsShared*)pfs_malloc(PFS_SHARED_HEADER_SIZE + ent->inflatedLen);
+    if (!sh) return PFS_OUT_OF_MEMORY;
+    
+    pfs_stat_alloc(pfs, PFS_SHARED_HEADER_SIZE + ent->inflatedLen);
+    inf = pfs_inflater_acquire(pfs, &local);
+    rc = pfs_inflate_entry(pfs, inf, ent, pfs_shared_data(sh));
+    pfs_inflater_return(pfs, inf, &local);
+    
+    if (rc)
+    {
+        pfs_free(sh);
+        return rc;
+    }
+    
+    sh->refs = 0;
+    sh->length = ent->inflatedLen;
+    sh->index = (uint32_t)index;
+    sh->prev = NULL;
+    sh->next = NULL;
+    
+    pfs_lock(pfs);
+    
+    cached = pfs_cache_find(cache, (uint32_t)index);
+    
+    if (cached)
+    {
+        /* Another reader inflated it meanwhile */
+        pfs_free(sh);
+        sh = cached;
+        pfs_cache_unlink(cache, sh);
+        pfs_cache_push_front(cache, sh);
+    }
+    else if (sh->length <= cache->budget && pfs_cache_reserve(cache) == PFS_OK)
+    {
+        /* Entries larger than the whole budget are handed out uncached */
+        pfs_cache_trim(pfs, sh->length);
+        pfs_cache_push_front(cache, sh);
+        pfs_cache_table_insert(cache, sh);
+        cache->bytes += sh->length;
+        cache->count++;
+        sh->refs = 1;
+    }
+    
+done:
+    /* Taken before unlocking, so a concurrent eviction can't free it first */
+#ifdef PFS_HAVE_THREADS
+    __sync_add_and_fetch(&sh->refs, 1);
+#else
+    sh->refs++;
+#endif
+    pfs_unlock(pfs);
+    
+    *data = pfs_shared_data(sh);
+    *length = sh->length;
+    return PFS_OK;
+}
+
+int pfs_file_data_shared(PFS* pfs, const char* name, const uint8_t** data, uint32_t* length)
+{
+    uint64_t start = pfs_trace_begin();
+    int rc = pfs_file_data_shared_impl(pfs, name, data, length);
+    
+    pfs_trace_end(PFS_TRACE_READ, name, (rc == PFS_OK) ? *length : 0, start, rc);
+    return rc;
+}
+
+void pfs_file_data_release(const uint8_t* data)
+{
+    if (data)
+        pfs_shared_release(pfs_shared_from_data(data));
+}
+
+int pfs_set_cache_budget(PFS* pfs, uint32_t bytes)
+{
+    if (!pfs) return PFS_MISUSE;
+    
+    pfs_lock(pfs);
+    pfs->cache.budget = bytes;
+    pfs_cache_trim(pfs, 0);
+    pfs_unlock(pfs);
+    return PFS_OK;
+}
+
+void pfs_cache_stats(PFS* pfs, PfsCacheStats* stats)
+{
+    if (!pfs || !stats) return;
+    
+    pfs_lock(pfs);
+    stats->hits = pfs->cache.hits;
+    stats->misses = pfs->cache.misses;
+    stats->evictions = pfs->cache.evictions;
+    stats->bytes = pfs->cache.bytes;
+    stats->count = pfs->cache.count;
+    pfs_unlock(pfs);
+}
+
+int pfs_get_stats(PFS* pfs, PfsStats* stats)
+{
+#ifndef PFS_NO_STATS
+    uint64_t* src;
+    uint64_t* dst;
+    uint32_t i;
+#endif
+    
+    if (!stats) return PFS_MISUSE;
+    
+#ifndef PFS_NO_STATS
+    /* Every field is a uint64_t counter, read one at a time */
+    src = (uint64_t*)((pfs) ? &pfs->stats : &pfs_global_stats);
+    dst = (uint64_t*)stats;
+    
+    for (i = 0; i < sizeof(PfsStats) / sizeof(uint64_t); i++)
+    {
+        dst[i] = pfs_stat_read(&src[i]);
+    }
+#else
+    (void)pfs;
+    memset(stats, 0, sizeof(PfsStats));
+#endif
+    
+    return PFS_OK;
+}
+
+void pfs_reset_stats(PFS* pfs)
+{
+#ifndef PFS_NO_STATS
+    uint64_t* dst = (uint64_t*)((pfs) ? &pfs->stats : &pfs_global_stats);
+    uint32_t i;
+    
+    for (i = 0; i < sizeof(PfsStats) / sizeof(uint64_t); i++)
+    {
+        pfs_stat_write(&dst[i], 0);
+    }
+#else
+    (void)pfs;
+#endif
+}
+
+void pfs_set_trace(PfsTraceFn fn, void* userdata)
+{
+#ifndef PFS_NO_STATS
+    pfs_trace_userdata = userdata;
+    pfs_trace_fn = fn;
+#else
+    (void)fn;
+    (void)userdata;
+#endif
+}
+
+int pfs_stream_open(PfsStream** outStream, PFS* pfs, const char* name)
+{
+    PfsStream* stream;
+    PfsEntry* ent;
+    uint32_t i, maxLen;
+    int index;
+    int rc;
+    
+    if (!outStream || !pfs || !name)
+        return PFS_MISUSE;
+    
+    index = pfs_file_index_by_name(pfs, name);
+    if (index < 0) return index;
+    
+    ent = &pfs->entries[index];
+    
+    rc = pfs_entry_resolve(pfs, ent);
+    if (rc) return rc;
+    
+    stream = (PfsStream*)pfs_malloc(sizeof(PfsStream));
+    if (!stream) return PFS_OUT_OF_MEMORY;
+    
+    stream->pfs = pfs;
+    stream->src = (ent->inserted) ? ent->inserted : pfs->data + ent->offset;
+    stream->size = ent->inflatedLen;
+    stream->pos = 0;
+    stream->buffer = NULL;
+    pfs_inflater_init(&stream->inflater);
+    
+    rc = pfs_index_blocks(stream->src, ent->deflatedLen, ent->inflatedLen, &stream->blocks, &stream->blockCount);
+    
+    if (rc)
+    {
+        pfs_free(stream);
+        return rc;
+    }
+    
+    stream->buffered = stream->blockCount;
+    maxLen = 0;
+    
+    for (i = 0; i < stream->blockCount; i++)
+    {
+        if (stream->blocks[i].inflatedLen > maxLen)
+            maxLen = stream->blocks[i].inflatedLen;
+    }
+    
+    if (maxLen)
+    {
+        stream->buffer = (uint8_t*)pfs_malloc(maxLen);
         
-        if (!foundTraceDotDbg && strcmp(name, "trace.dbg") == 0)
+        if (!stream->buffer)
         {
-            n--;
-            pfs->count = n;
-            foundTraceDotDbg = 1;
-            continue;
+            pfs_stream_close(stream);
+            return PFS_OUT_OF_MEMORY;
         }
         
-        pfs->hashes[i] = pfs_hash(name, namelen - 1);
-        ent = &pfs->entries[i];
-        ent->name = name;
-        
-        i++;
+        pfs_stat_alloc(pfs, maxLen);
     }
     
-    pfs->count = n;
-done:
-    *outPfs = pfs;
+    *outStream = stream;
     return PFS_OK;
-    
-fail:
-    pfs_close(pfs);
-fail_alloc:
-    *outPfs = NULL;
-    return rc;
 }
 
-int pfs_open(PFS** outPfs, const char* path)
+static uint32_t pfs_stream_block_at(PfsStream* stream, uint32_t pos)
 {
-    FILE* fp;
-    uint8_t* data;
-    uint32_t length;
-    int rc = PFS_NOT_FOUND;
+    PfsBlockRef* blocks = stream->blocks;
+    uint32_t lo = 0;
+    uint32_t hi = stream->blockCount;
     
-    if (!outPfs || !path)
+    /* Last block starting at or before pos */
+    while (hi - lo > 1)
     {
-        rc = PFS_MISUSE;
-        goto fail;
+        uint32_t mid = lo + (hi - lo) / 2;
+        
+        if (blocks[mid].dstPos <= pos)
+            lo = mid;
+        else
+            hi = mid;
     }
     
-    fp = fopen(path, "rb");
-    if (!fp) goto fail;
-    
-    fseek(fp, 0, SEEK_END);
-    length = (uint32_t)ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-    
-    if (length == 0)
-        goto fail_file_open;
+    return lo;
+}
+
+int pfs_stream_read(PfsStream* stream, void* buf, uint32_t length, uint32_t* outRead)
+{
+    uint8_t* dst = (uint8_t*)buf;
+    uint32_t read = 0;
+    int rc = PFS_OK;
     
-    data = (uint8_t*)malloc(length);
+    if (!stream || (!buf && length) || !outRead)
+        return PFS_MISUSE;
     
-    if (!data)
+    while (read < length && stream->pos < stream->size)
     {
-        rc = PFS_OUT_OF_MEMORY;
-        goto fail_file_open;
+        uint32_t b = pfs_stream_block_at(stream, stream->pos);
+        PfsBlockRef* ref = &stream->blocks[b];
+        uint32_t skip = stream->pos - ref->dstPos;
+        uint32_t n = ref->inflatedLen - skip;
+        
+        if (n > length - read)
+            n = length - read;
+        
+        if (b != stream->buffered && n == ref->inflatedLen)
+        {
+            /* A whole block wanted: inflate it straight into the caller's buffer */
+            rc = pfs_inflate_block(stream->pfs, &stream->inflater, dst + read, n, stream->src + ref->srcPos, ref->deflatedLen);
+            if (rc) break;
+        }
+        else
+        {
+            if (b != stream->buffered)
+            {
+                stream->buffered = stream->blockCount;
+                rc = pfs_inflate_block(stream->pfs, &stream->inflater, stream->buffer, ref->inflatedLen, stream->src + ref->srcPos, ref->deflatedLen);
+                if (rc) break;
+                stream->buffered = b;
+            }
+            
+            memcpy(dst + read, stream->buffer + skip, n);
+        }
+        
+        read += n;
+        stream->pos += n;
     }
     
-    if (fread(data, sizeof(uint8_t), length, fp) != length)
+    *outRead = read;
+    return rc;
+}
+
+int pfs_stream_seek(PfsStream* stream, uint32_t offset)
+{
+    if (!stream)
+        return PFS_MISUSE;
+    
+    if (offset > stream->size)
+        return PFS_OUT_OF_BOUNDS;
+    
+    stream->pos = offset;
+    return PFS_OK;
+}
+
+uint32_t pfs_stream_tell(PfsStream* stream)
+{
+    return (stream) ? stream->pos : 0;
+}
+
+uint32_t pfs_stream_size(PfsStream* stream)
+{
+    return (stream) ? stream->size : 0;
+}
+
+void pfs_stream_close(PfsStream* stream)
+{
+    if (stream)
     {
-        free(data);
-        rc = PFS_FILE_ERROR;
-        goto fail_file_open;
+        pfs_inflater_release(&stream->inflater);
+        pfs_free_if_exists(stream->blocks);
+        pfs_free_if_exists(stream->buffer);
+        pfs_free(stream);
     }
+}
+
+typedef struct {
+    PFS*                pfs;
+    const uint8_t*      src;
+    uint8_t*            dst;
+    const PfsBlockRef*  blocks;
+    PfsInflater*        inflaters;
+    int*                rcs;
+} PfsInflateBatch;
+
+static void pfs_inflate_blocks_job(void* arg, uint32_t worker, uint32_t item)
+{
+    PfsInflateBatch* batch = (PfsInflateBatch*)arg;
+    const PfsBlockRef* ref = &batch->blocks[item];
     
-    rc = pfs_open_impl(outPfs, data, length, 1);
-    
-fail_file_open:
-    fclose(fp);
-fail:
-    return rc;
+    batch->rcs[item] = pfs_inflate_block(batch->pfs, &batch->inflaters[worker], batch->dst + ref->dstPos, ref->inflatedLen, batch->src + ref->srcPos, ref->deflatedLen);
 }
 
-int pfs_open_from_memory(PFS** outPfs, const void* data, uint32_t length)
+static int pfs_file_data_parallel_impl(PFS* pfs, const char* name, uint8_t** data, uint32_t* length, uint32_t nthreads)
 {
-    uint8_t* copy;
+    PfsInflateBatch batch;
+    PfsBlockRef* blocks = NULL;
+    PfsEntry* ent;
+    uint8_t* dst = NULL;
+    uint32_t count, i;
+    int index;
     int rc;
     
-    if (!outPfs || !data || !length)
+    if (!pfs || !name || !data || !length)
+        return PFS_MISUSE;
+    
+    index = pfs_file_index_by_name(pfs, name);
+    if (index < 0) return index;
+    
+    ent = &pfs->entries[index];
+    
+    rc = pfs_entry_resolve(pfs, ent);
+    if (rc) return rc;
+    
+    /* Below this, starting threads costs more than it saves */
+    if (ent->inflatedLen < PFS_PARALLEL_MIN_SIZE)
     {
-        rc = PFS_MISUSE;
-        goto fail;
+        PfsInflater local;
+        PfsInflater* inf = pfs_inflater_acquire(pfs, &local);
+        
+        rc = pfs_decompress_index(pfs, inf, data, length, (uint32_t)index);
+        pfs_inflater_return(pfs, inf, &local);
+        return rc;
     }
     
-    copy = (uint8_t*)malloc(length);
+    batch.pfs = pfs;
+    batch.src = (ent->inserted) ? ent->inserted : pfs->data + ent->offset;
     
-    if (!copy)
+    rc = pfs_index_blocks(batch.src, ent->deflatedLen, ent->inflatedLen, &blocks, &count);
+    if (rc) return rc;
+    
+    nthreads = pfs_thread_count(nthreads, count);
+    
+    dst = (uint8_t*)pfs_malloc(ent->inflatedLen);
+    batch.dst = dst;
+    batch.blocks = blocks;
+    batch.inflaters = (PfsInflater*)pfs_calloc(nthreads, sizeof(PfsInflater));
+    batch.rcs = (int*)pfs_calloc(count, sizeof(int));
+    
+    rc = PFS_OUT_OF_MEMORY;
+    
+    if (!dst || !batch.inflaters || !batch.rcs)
+        goto abort;
+    
+    pfs_stat_alloc(pfs, ent->inflatedLen);
+    
+    /* Every block is a self-contained zlib stream writing to its own slice of the output */
+    pfs_parallel_for(nthreads, count, pfs_inflate_blocks_job, &batch);
+    
+    rc = PFS_OK;
+    
+    for (i = 0; i < count && rc == PFS_OK; i++)
     {
-        rc = PFS_OUT_OF_MEMORY;
-        goto fail;
+        rc = batch.rcs[i];
     }
     
-    memcpy(copy, data, length);
+    if (rc == PFS_OK)
+    {
+        *data = dst;
+        *length = ent->inflatedLen;
+        dst = NULL;
+    }
     
-    rc = pfs_open_impl(outPfs, copy, length, 1);
+abort:
+    if (batch.inflaters)
+    {
+        for (i = 0; i < nthreads; i++)
+        {
+            pfs_inflater_release(&batch.inflaters[i]);
+        }
+    }
+    
+    pfs_free_if_exists(dst);
+    pfs_free_if_exists(blocks);
+    pfs_free_if_exists(batch.inflaters);
+    pfs_free_if_exists(batch.rcs);
     
-fail:
     return rc;
 }
 
-int pfs_open_from_memory_no_copy(PFS** outPfs, const void* data, uint32_t length)
+int pfs_file_data_parallel(PFS* pfs, const char* name, uint8_t** data, uint32_t* length, uint32_t nthreads)
 {
-    return pfs_open_impl(outPfs, (const uint8_t*)data, length, 0);
+    uint64_t start = pfs_trace_begin();
+    int rc = pfs_file_data_parallel_impl(pfs, name, data, length, nthreads);
+    
+    pfs_trace_end(PFS_TRACE_READ, name, (rc == PFS_OK) ? *length : 0, start, rc);
+    return rc;
 }
 
-int pfs_create_new(PFS** outPfs)
+typedef struct {
+    uint32_t    offset;     /* Where the data starts in the archive, PFS_OFFSET_NONE if it is held in memory */
+    uint32_t    item;
+    uint32_t    index;
+} PfsReadOrder;
+
+typedef struct {
+    PFS*                pfs;
+    const char* const*  names;
+    const PfsReadOrder* order;
+    PfsInflater*        first;      /* The calling thread's */
+    PfsInflater*        rest;       /* One per further worker */
+    uint8_t**           datas;
+    uint32_t*           lengths;
+    int*                rcs;
+} PfsReadBatch;
+
+static int pfs_sort_read_order(const void* va, const void* vb)
 {
-    PFS* pfs;
-    
-    if (!outPfs) return PFS_MISUSE;
+    const PfsReadOrder* a = (const PfsReadOrder*)va;
+    const PfsReadOrder* b = (const PfsReadOrder*)vb;
     
-    pfs = (PFS*)malloc(sizeof(PFS));
+    if (a->offset != b->offset)
+        return (a->offset < b->offset) ? -1 : 1;
     
-    if (!pfs) return PFS_OUT_OF_MEMORY;
-    
-    memset(pfs, 0, sizeof(PFS));
-    *outPfs = pfs;
-    return PFS_OK;
+    return (a->item < b->item) ? -1 : (a->item > b->item);
 }
 
-void pfs_close(PFS* pfs)
+#ifndef _WIN32
+/*
+** Mapped archives are advised MADV_RANDOM, so nothing is read ahead; ask for the batch's ranges instead, merged where
+** they touch. An entry of a lazy handle whose chain hasn't been walked yet is bounded by its inflated size.
+*/
+static void pfs_prefetch(PFS* pfs, const PfsReadOrder* order, uint32_t count)
 {
-    if (pfs)
+    uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t start = 0;
+    uintptr_t end = 0;
+    uint32_t i;
+    
+    for (i = 0; i < count && order[i].offset != PFS_OFFSET_NONE; i++)
     {
-        PfsEntry* entries = pfs->entries;
-        
-        if (entries)
-        {
-            uint32_t n = pfs->count;
-            uint32_t i;
-            
-            for (i = 0; i < n; i++)
-            {
-                PfsEntry* ent = &entries[i];
-                
-                if (ent->inserted && ent->insertedIsCopy)
-                {
-                    free(ent->inserted);
-                }
-                ent->inserted = NULL;
-                
-                if (ent->nameIsCopy && ent->name)
-                {
-                    free(ent->name);
-                }
-                ent->name = NULL;
-            }
-            
-            free(entries);
-            pfs->entries = NULL;
-        }
+        PfsEntry* ent = &pfs->entries[order[i].index];
+        uint32_t len = pfs_atomic_load(&ent->deflatedLen);
+        uintptr_t a, b;
         
-        if (pfs->hashes)
-        {
-            free(pfs->hashes);
-            pfs->hashes = NULL;
-        }
+        if (len == PFS_DEFLATED_LEN_UNKNOWN)
+            len = (ent->inflatedLen < pfs->length - ent->offset) ? ent->inflatedLen : pfs->length - ent->offset;
         
-        if (pfs->dataIsCopy && pfs->data)
-            free(pfs->data);
-        pfs->data = NULL;
+        a = (uintptr_t)(pfs->data + ent->offset) & ~(page - 1);
+        b = (uintptr_t)(pfs->data + ent->offset + len);
         
-        if (pfs->nameData)
+        if (end && a <= end)
         {
-            free(pfs->nameData);
-            pfs->nameData = NULL;
+            if (b > end) end = b;
+            continue;
         }
         
-        free(pfs);
+        if (end) madvise((void*)start, end - start, MADV_WILLNEED);
+        
+        start = a;
+        end = b;
     }
+    
+    if (end) madvise((void*)start, end - start, MADV_WILLNEED);
 }
+#endif
 
-uint32_t pfs_file_count(PFS* pfs)
+static void pfs_file_data_many_job(void* arg, uint32_t worker, uint32_t item)
 {
-    return (pfs) ? pfs->count : 0;
+    PfsReadBatch* batch = (PfsReadBatch*)arg;
+    const PfsReadOrder* o = &batch->order[item];
+    PfsInflater* inf = (worker) ? &batch->rest[worker - 1] : batch->first;
+    uint64_t start = pfs_trace_begin();
+    int rc;
+    
+    rc = pfs_decompress_index(batch->pfs, inf, &batch->datas[o->item], &batch->lengths[o->item], o->index);
+    batch->rcs[o->item] = rc;
+    
+    pfs_trace_end(PFS_TRACE_READ, batch->names[o->item], (rc == PFS_OK) ? batch->lengths[o->item] : 0, start, rc);
 }
 
-#define PFS_COMPRESS_INPUT_SIZE 8192
-#define PFS_COMPRESS_BUFFER_SIZE (PFS_COMPRESS_INPUT_SIZE + 128) /* Overflow space for things that can't be compressed any further... */
-
-static int pfs_compress(PfsEntry* ent, const void* data, uint32_t length)
+int pfs_file_data_many(PFS* pfs, const char* const* names, uint32_t count, uint8_t** datas, uint32_t* lengths, int* rcs, uint32_t nthreads)
 {
-    const uint8_t* ptr = (const uint8_t*)data;
-    uint8_t tmp[PFS_COMPRESS_BUFFER_SIZE];
-    uint32_t dlen = 0;
+    PfsReadBatch batch;
+    PfsReadOrder* order;
+    PfsInflater local;
+    uint64_t total = 0;
+    uint32_t n = 0;
+    uint32_t i;
+    
+    if (!pfs || (count && (!names || !datas || !lengths || !rcs)))
+        return PFS_MISUSE;
     
-    ent->insertedIsCopy = 1;
-    ent->inflatedLen = length;
+    if (count == 0)
+        return PFS_OK;
     
-    while (length > 0)
+    order = (PfsReadOrder*)pfs_malloc(sizeof(PfsReadOrder) * count);
+    if (!order) return PFS_OUT_OF_MEMORY;
+    
+    /* Every lookup first, so the reads below can go through the archive front to back */
+    for (i = 0; i < count; i++)
     {
-        uint32_t r = (length < PFS_COMPRESS_INPUT_SIZE) ? length : PFS_COMPRESS_INPUT_SIZE;
-        unsigned long dstlen;
-        PfsBlock block;
-        uint8_t* inserted;
-        uint32_t prevlen;
-        int rc;
+        int index = (names[i]) ? pfs_file_index_by_name(pfs, names[i]) : PFS_MISUSE;
         
-        block.inflatedLen = r;
-        dstlen = sizeof(tmp);
-        
-        rc = compress2(tmp, &dstlen, ptr, r, Z_BEST_COMPRESSION);
-        
-        if (rc != Z_OK) return PFS_COMPRESSION_ERROR;
-        
-        block.deflatedLen = dstlen;
+        datas[i] = NULL;
+        lengths[i] = 0;
+        rcs[i] = index;
         
-        prevlen = dlen;
-        dlen += dstlen + sizeof(block);
-        inserted = (uint8_t*)realloc(ent->inserted, dlen);
-        if (!inserted) return PFS_OUT_OF_MEMORY;
-        ent->inserted = inserted;
+        if (index < 0)
+            continue;
         
-        inserted += prevlen;
-        memcpy(inserted, &block, sizeof(block));
-        memcpy(inserted + sizeof(block), tmp, dstlen);
+        order[n].offset = (pfs->entries[index].inserted) ? PFS_OFFSET_NONE : pfs->entries[index].offset;
+        order[n].item = i;
+        order[n].index = (uint32_t)index;
+        total += pfs->entries[index].inflatedLen;
+        n++;
+    }
+    
+    qsort(order, n, sizeof(PfsReadOrder), pfs_sort_read_order);
+    
+#ifndef _WIN32
+    if (pfs->dataOwner == PFS_DATA_MMAP)
+        pfs_prefetch(pfs, order, n);
+#endif
+    
+    /* Same threshold as for a single entry: below it, starting threads costs more than it saves */
+    nthreads = (total < PFS_PARALLEL_MIN_SIZE) ? 1 : pfs_thread_count(nthreads, n);
+    
+    batch.pfs = pfs;
+    batch.names = names;
+    batch.order = order;
+    batch.rest = NULL;
+    batch.datas = datas;
+    batch.lengths = lengths;
+    batch.rcs = rcs;
+    
+    if (nthreads > 1)
+    {
+        batch.rest = (PfsInflater*)pfs_calloc(nthreads - 1, sizeof(PfsInflater));
+        if (!batch.rest) nthreads = 1;
+    }
+    
+    batch.first = pfs_inflater_acquire(pfs, &local);
+    pfs_parallel_for(nthreads, n, pfs_file_data_many_job, &batch);
+    pfs_inflater_return(pfs, batch.first, &local);
+    
+    if (batch.rest)
+    {
+        for (i = 0; i < nthreads - 1; i++)
+        {
+            pfs_inflater_release(&batch.rest[i]);
+        }
         
-        length -= r;
-        ptr += r;
+        pfs_free(batch.rest);
     }
     
-    ent->deflatedLen = dlen;
+    pfs_free(order);
+    
+    for (i = 0; i < count; i++)
+    {
+        if (rcs[i]) return rcs[i];
+    }
     
     return PFS_OK;
 }
 
-static int pfs_buf_append(PfsBuf* buf, const void* data, uint32_t length)
+int pfs_inflater_create(PfsInflater** outInf)
 {
-    uint32_t cur = buf->length;
-    uint32_t len = cur + length;
-    uint8_t* array = (uint8_t*)realloc(buf->data, len);
+    PfsInflater* inf;
     
-    if (!array) return PFS_OUT_OF_MEMORY;
+    if (!outInf) return PFS_MISUSE;
     
-    memcpy(array + cur, data, length);
+    inf = (PfsInflater*)pfs_malloc(sizeof(PfsInflater));
     
-    buf->data = array;
-    buf->length = len;
+    if (!inf) return PFS_OUT_OF_MEMORY;
     
+    pfs_inflater_init(inf);
+    *outInf = inf;
     return PFS_OK;
 }
 
-static int pfs_sort_by_crc(const void* va, const void* vb)
+void pfs_inflater_destroy(PfsInflater* inf)
 {
-    const PfsFileEntry* a = (const PfsFileEntry*)va;
-    const PfsFileEntry* b = (const PfsFileEntry*)vb;
-    
-    return (a->crc < b->crc) ? -1 : 1;
+    if (inf)
+    {
+        pfs_inflater_release(inf);
+        pfs_free(inf);
+    }
 }
 
-int pfs_write_to_disk(PFS* pfs, const char* path)
+/*
+** Sidecar index: everything pfs_open_impl() and pfs_load_names() work out, in the order pfs_open_impl() sorts entries.
+** Native byte order and relative offsets only, so it can be mapped and checked without parsing. Keyed on the
+** archive's size and mtime plus the offset and CRC of its directory; the body carries its own CRC, and every entry CRC
+** and slot is checked against the names before anything is taken from it.
+*/
+#define PFS_INDEX_MAGIC "PFSX"
+#define PFS_INDEX_VERSION 3
+
+typedef struct {
+    char        magic[4];
+    uint32_t    version;
+    uint64_t    archiveMtime;
+    uint32_t    archiveSize;
+    uint32_t    dirOffset;
+    uint32_t    dirCrc;
+    uint32_t    count;          /* Entries, not counting the name data entry */
+    uint32_t    slotCount;
+    uint32_t    namesLen;
+    uint32_t    fileNamesLen;
+    uint32_t    bodyCrc;        /* zlib crc32() of everything after the header */
+} PfsIndexHeader;
+
+typedef struct {
+    uint32_t    crc;
+    uint32_t    offset;
+    uint32_t    inflatedLen;
+    uint32_t    deflatedLen;
+    uint32_t    name;           /* Offset into the names */
+} PfsIndexEntry;
+
+/* Followed by slots[slotCount], by name CRC as the handle's own, and the null terminated names */
+
+#ifndef _WIN32
+int pfs_write_index(PFS* pfs, const char* path, const char* indexPath)
 {
+    PfsIndexHeader header;
+    PfsIndexEntry* entries = NULL;
+    uint32_t* slots = NULL;
+    uint32_t* order = NULL;
+    struct stat st;
     FILE* fp;
-    PfsHeader header;
-    PfsFileEntry fent;
-    PfsFileEntry* fileEntries;
-    PfsBuf dataBuf;
-    PfsBuf nameBuf;
-    PfsEntry nameBufCompressed;
-    uint32_t p, n, i, c;
-    uint8_t* pfsData = pfs->data;
-    int rc = PFS_OK;
+    char* tmp = NULL;
+    uint32_t n, i, mask, namePos;
+    int rc;
     
-    if (!pfs || !path || *path == 0)
+    if (!pfs || !path || !indexPath || *indexPath == 0)
         return PFS_MISUSE;
     
-    memcpy(&header.signature, "PFS ", sizeof(header.signature));
-    header.unknown = 131072; /* Always this */
+    rc = pfs_require_names(pfs);
+    if (rc) return rc;
+    
+    n = pfs->count;
+    
+    /* Only a handle that matches its archive exactly can describe it */
+    if (pfs->fileLength == 0)
+        return PFS_MISUSE;
+    
+    for (i = 0; i < n; i++)
+    {
+        if (pfs->cold[i].fileOffset == PFS_OFFSET_NONE)
+            return PFS_MISUSE;
+    }
+    
+    fp = fopen(path, "rb");
+    if (!fp) return PFS_NOT_FOUND;
+    
+    rc = (pfs_file_matches(pfs, fp) && fstat(fileno(fp), &st) == 0) ? PFS_OK : PFS_MISUSE;
+    fclose(fp);
+    if (rc) return rc;
+    
+    memcpy(header.magic, PFS_INDEX_MAGIC, sizeof(header.magic));
+    header.version = PFS_INDEX_VERSION;
+    header.archiveMtime = (uint64_t)st.st_mtime;
+    header.archiveSize = pfs->fileLength;
+    header.dirOffset = pfs->fileDirOffset;
+    header.dirCrc = pfs->fileDirCrc;
+    header.count = n;
+    header.slotCount = pfs_pow2_greater_or_equal(n * 2);
+    header.fileNamesLen = pfs->fileNamesLen;
+    
+    if (header.slotCount < PFS_INDEX_MIN_SLOTS)
+        header.slotCount = PFS_INDEX_MIN_SLOTS;
+    
+    entries = (PfsIndexEntry*)pfs_malloc(sizeof(PfsIndexEntry) * (n ? n : 1));
+    slots = (uint32_t*)pfs_calloc(header.slotCount, sizeof(uint32_t));
+    order = (uint32_t*)pfs_malloc(sizeof(uint32_t) * 3 * (n ? n : 1));
     
-    p = sizeof(PfsHeader);
-    c = pfs->count;
+    rc = PFS_OUT_OF_MEMORY;
     
-    fileEntries = (PfsFileEntry*)malloc(sizeof(PfsFileEntry) * (c + 1));
-    if (!fileEntries) return PFS_OUT_OF_MEMORY;
+    if (!entries || !slots || !order)
+        goto abort;
+    
+    for (i = 0; i < n; i++)
+    {
+        order[i * 3] = pfs->cold[i].fileOffset;
+        order[i * 3 + 1] = pfs->entries[i].crc;
+        order[i * 3 + 2] = i;
+    }
     
-    dataBuf.data = NULL;
-    dataBuf.length = 0;
-    nameBuf.data = NULL;
-    nameBuf.length = 0;
-    nameBufCompressed.inserted = NULL;
+    qsort(order, n, sizeof(uint32_t) * 3, pfs_sort_offset_crc);
     
-    rc = pfs_buf_append(&nameBuf, &c, sizeof(c));
-    if (rc) goto abort;
+    mask = header.slotCount - 1;
+    namePos = 0;
     
-    for (i = 0; i < c; i++)
+    for (i = 0; i < n; i++)
     {
-        PfsEntry* ent = &pfs->entries[i];
-        uint8_t* fileData;
-        
-        n = strlen(ent->name) + 1;
-        
-        rc = pfs_buf_append(&nameBuf, &n, sizeof(n));
-        if (rc) goto abort;
+        PfsEntry* ent = &pfs->entries[order[i * 3 + 2]];
+        uint32_t namelen = (uint32_t)strlen(ent->name);
+        uint32_t k = ent->crc & mask;
         
-        rc = pfs_buf_append(&nameBuf, ent->name, n);
+        rc = pfs_entry_resolve(pfs, ent);
         if (rc) goto abort;
         
-        fent.crc = ent->crc;
-        fent.offset = p;
-        fent.inflatedLen = ent->inflatedLen;
-        
-        fileEntries[i] = fent;
+        entries[i].crc = ent->crc;
+        entries[i].offset = pfs_cold(pfs, ent)->fileOffset;
+        entries[i].inflatedLen = ent->inflatedLen;
+        entries[i].deflatedLen = ent->deflatedLen;
+        entries[i].name = namePos;
+        namePos += namelen + 1;
         
-        fileData = (ent->inserted) ? ent->inserted : (pfsData + ent->offset);
-        
-        rc = pfs_buf_append(&dataBuf, fileData, ent->deflatedLen);
-        if (rc) goto abort;
+        while (slots[k] != 0)
+        {
+            k = (k + 1) & mask;
+        }
         
-        p += ent->deflatedLen;
+        slots[k] = i + 1;
     }
     
-    /* Names entry */
-    fent.crc = 0x61580ac9; /* Always this */
-    fent.offset = p;
-    fent.inflatedLen = nameBuf.length;
+    header.namesLen = namePos;
+    header.bodyCrc = (uint32_t)crc32(0L, Z_NULL, 0);
+    header.bodyCrc = (uint32_t)crc32(header.bodyCrc, (const Bytef*)entries, sizeof(PfsIndexEntry) * n);
+    header.bodyCrc = (uint32_t)crc32(header.bodyCrc, (const Bytef*)slots, sizeof(uint32_t) * header.slotCount);
     
-    fileEntries[c] = fent;
-    qsort(fileEntries, c + 1, sizeof(PfsFileEntry), pfs_sort_by_crc);
+    for (i = 0; i < n; i++)
+    {
+        const char* name = pfs->entries[order[i * 3 + 2]].name;
+        
+        header.bodyCrc = (uint32_t)crc32(header.bodyCrc, (const Bytef*)name, (uInt)strlen(name) + 1);
+    }
     
-    rc = pfs_compress(&nameBufCompressed, nameBuf.data, nameBuf.length);
-    if (rc) goto abort;
+    /* Written aside and renamed, so processes mapping the old one never see a partial file */
+    fp = pfs_temp_open(indexPath, &tmp);
     
-    p += nameBufCompressed.deflatedLen;
+    if (!fp)
+    {
+        rc = tmp ? PFS_FILE_ERROR : PFS_OUT_OF_MEMORY;
+        goto abort;
+    }
     
-    header.offset = p;
     rc = PFS_FILE_ERROR;
-    fp = fopen(path, "wb+");
-    if (!fp) goto abort;
-
-    /* Header */
-    if (fwrite(&header, sizeof(uint8_t), sizeof(header), fp) != sizeof(header))
-        goto close_file;
-    
-    /* Compressed entries */
-    n = dataBuf.length;
-    if (fwrite(dataBuf.data, sizeof(uint8_t), n, fp) != n)
-        goto close_file;
-    
-    /* Compressed names entry */
-    if (fwrite(nameBufCompressed.inserted, sizeof(uint8_t), nameBufCompressed.deflatedLen, fp) != nameBufCompressed.deflatedLen)
-        goto close_file;
-    
-    /* Offset and CRC list in order of CRC */
-    n = c + 1;
-    if (fwrite(&n, sizeof(uint8_t), sizeof(n), fp) != sizeof(n))
-        goto close_file;
     
-    for (i = 0; i < n; i++)
+    if (fwrite(&header, sizeof(header), 1, fp) == 1 &&
+        fwrite(entries, sizeof(PfsIndexEntry), n, fp) == n &&
+        fwrite(slots, sizeof(uint32_t), header.slotCount, fp) == header.slotCount)
     {
-        PfsFileEntry* ent = &fileEntries[i];
+        rc = PFS_OK;
         
-        if (fwrite(ent, sizeof(uint8_t), sizeof(PfsFileEntry), fp) != sizeof(PfsFileEntry))
-            goto close_file;
+        for (i = 0; i < n && rc == PFS_OK; i++)
+        {
+            const char* name = pfs->entries[order[i * 3 + 2]].name;
+            
+            if (fwrite(name, strlen(name) + 1, 1, fp) != 1)
+                rc = PFS_FILE_ERROR;
+        }
     }
     
-    rc = PFS_OK;
+    if (fclose(fp) != 0 && rc == PFS_OK)
+        rc = PFS_FILE_ERROR;
     
-close_file:
-    fclose(fp);
+    if (rc == PFS_OK && rename(tmp, indexPath) != 0)
+        rc = PFS_FILE_ERROR;
     
-abort:
-    pfs_free_if_exists(fileEntries);
-    pfs_free_if_exists(dataBuf.data);
-    pfs_free_if_exists(nameBuf.data);
-    pfs_free_if_exists(nameBufCompressed.inserted);
+    if (rc)
+        remove(tmp);
     
+abort:
+    pfs_free_if_exists(tmp);
+    pfs_free_if_exists(entries);
+    pfs_free_if_exists(slots);
+    pfs_free_if_exists(order);
     return rc;
 }
 
-static int pfs_file_index_by_name(PFS* pfs, const char* name)
+/* Takes names, index and block chain lengths from a sidecar that matches the freshly opened directory */
+static int pfs_adopt_index(PFS* pfs, const uint8_t* index, uint32_t indexLen)
 {
-    uint32_t* hashes;
-    uint32_t hash, n, i;
+    const PfsIndexHeader* header = (const PfsIndexHeader*)index;
+    const PfsIndexEntry* entries;
+    const uint32_t* slots;
+    const char* names;
+    uint32_t n = header->count;
+    uint32_t used = 0;
+    uint32_t i, mask;
+    uint64_t need;
     
-    if (!pfs || !name)
-        return PFS_MISUSE;
+    need = sizeof(PfsIndexHeader) + (uint64_t)n * sizeof(PfsIndexEntry) +
+        (uint64_t)header->slotCount * sizeof(uint32_t) + header->namesLen;
     
-    hash = pfs_hash(name, strlen(name));
-    n = pfs->count;
-    hashes = pfs->hashes;
+    if (need != indexLen || header->dirOffset != pfs->fileDirOffset || header->dirCrc != pfs->fileDirCrc)
+        return PFS_CORRUPTED;
+    
+    if (n + 1 != pfs->dirCount || n != pfs->count || header->slotCount < n * 2 || !pfs_is_pow2(header->slotCount))
+        return PFS_CORRUPTED;
+    
+    if ((uint32_t)crc32(crc32(0L, Z_NULL, 0), index + sizeof(PfsIndexHeader), indexLen - sizeof(PfsIndexHeader)) != header->bodyCrc)
+        return PFS_CORRUPTED;
+    
+    entries = (const PfsIndexEntry*)(index + sizeof(PfsIndexHeader));
+    slots = (const uint32_t*)(entries + n);
+    names = (const char*)(slots + header->slotCount);
+    
+    if (header->namesLen == 0 || names[header->namesLen - 1] != 0)
+        return PFS_CORRUPTED;
+    
+    /* Same entries in the same order, nothing pointing outside the archive, the names or the entries, CRCs that match */
+    for (i = 0; i < n; i++)
+    {
+        const PfsEntry* ent = &pfs->entries[i];
+        const PfsIndexEntry* src = &entries[i];
+        
+        if (src->crc != ent->crc || src->offset != ent->offset || src->inflatedLen != ent->inflatedLen)
+            return PFS_CORRUPTED;
+        
+        if (src->offset > pfs->length || src->deflatedLen > pfs->length - src->offset || src->name >= header->namesLen)
+            return PFS_CORRUPTED;
+        
+        if (src->crc != pfs_crc(names + src->name, (uint32_t)strlen(names + src->name) + 1))
+            return PFS_CORRUPTED;
+    }
+    
+    for (i = 0; i < header->slotCount; i++)
+    {
+        if (slots[i] > n)
+            return PFS_CORRUPTED;
+        
+        used += (slots[i] != 0);
+    }
+    
+    /* As many slots in use as entries, and each entry reachable from its CRC, so each appears exactly once */
+    mask = header->slotCount - 1;
+    
+    if (used != n)
+        return PFS_CORRUPTED;
     
     for (i = 0; i < n; i++)
     {
-        if (hashes[i] == hash)
+        uint32_t k = entries[i].crc & mask;
+        
+        while (slots[k] != i + 1)
         {
-            PfsEntry* ent = &pfs->entries[i];
+            if (slots[k] == 0)
+                return PFS_CORRUPTED;
             
-            if (strcmp(ent->name, name) == 0)
-                return (int)i;
+            k = (k + 1) & mask;
         }
     }
     
-    return PFS_NOT_FOUND;
-}
-
-static PfsEntry* pfs_get_entry(PFS* pfs, const char* name)
-{
-    int index = pfs_file_index_by_name(pfs, name);
-    return (index >= 0) ? &pfs->entries[index] : NULL;
+    pfs_free_if_exists(pfs->slots);
+    pfs->nameData = (uint8_t*)pfs_malloc(header->namesLen);
+    pfs->slots = (uint32_t*)pfs_malloc(sizeof(uint32_t) * header->slotCount);
+    
+    if (!pfs->nameData || !pfs->slots)
+        return PFS_OUT_OF_MEMORY;
+    
+    memcpy(pfs->nameData, names, header->namesLen);
+    memcpy(pfs->slots, slots, sizeof(uint32_t) * header->slotCount);
+    pfs->slotCount = header->slotCount;
+    
+    for (i = 0; i < n; i++)
+    {
+        pfs->entries[i].deflatedLen = entries[i].deflatedLen;
+        pfs->entries[i].name = (char*)pfs->nameData + entries[i].name;
+    }
+    
+    pfs->fileNamesLen = header->fileNamesLen;
+    pfs->namesPending = 0;
+    return PFS_OK;
 }
 
-static PfsEntry* pfs_get_or_append_entry(PFS* pfs, const char* name)
+int pfs_open_indexed(PFS** outPfs, const char* path, const char* indexPath, int flags)
 {
-    int index = pfs_file_index_by_name(pfs, name);
-    PfsEntry* ent;
-    int namelen;
+    const PfsIndexHeader* header;
+    struct stat st;
+    void* index = MAP_FAILED;
+    uint32_t indexLen = 0;
+    int fd;
+    int rc;
     
-    if (index >= 0)
-        return &pfs->entries[index];
+    if (!outPfs || !path || !indexPath)
+        return PFS_MISUSE;
     
-    index = (int)pfs->count;
+    if (stat(path, &st) != 0)
+        return PFS_NOT_FOUND;
     
-    if (pfs_is_pow2_or_zero(index))
+    fd = open(indexPath, O_RDONLY);
+    
+    if (fd != -1)
     {
-        int cap = (index == 0) ? 1 : index * 2;
-        PfsEntry* entries;
-        uint32_t* hashes;
+        struct stat ist;
         
-        entries = (PfsEntry*)realloc(pfs->entries, sizeof(PfsEntry) * cap);
-        if (!entries) return NULL;
-        pfs->entries = entries;
+        if (fstat(fd, &ist) == 0 && ist.st_size >= (off_t)sizeof(PfsIndexHeader) && (uint64_t)ist.st_size <= 0xffffffffU)
+        {
+            indexLen = (uint32_t)ist.st_size;
+            index = mmap(NULL, indexLen, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
         
-        hashes = (uint32_t*)realloc(pfs->hashes, sizeof(uint32_t) * cap);
-        if (!hashes) return NULL;
-        pfs->hashes = hashes;
+        close(fd);
     }
     
-    namelen = strlen(name);
-    pfs->hashes[index] = pfs_hash(name, (uint32_t)namelen);
+    if (index == MAP_FAILED)
+        return pfs_open_ex(outPfs, path, flags);
     
-    ent = &pfs->entries[index];
-    ent->name = (char*)malloc(namelen + 1);
-    if (!ent->name) return NULL;
-    memcpy(ent->name, name, namelen);
-    ent->name[namelen] = 0;
+    header = (const PfsIndexHeader*)index;
     
-    ent->nameIsCopy = 1;
-    ent->insertedIsCopy = 0;
-    ent->crc = pfs_crc(name, namelen + 1); /* CRC includes the null terminator */
-    ent->offset = 0;
-    ent->inflatedLen = 0;
-    ent->deflatedLen = 0;
-    ent->inserted = NULL;
+    /* Stale or foreign: open the usual way */
+    if (memcmp(header->magic, PFS_INDEX_MAGIC, sizeof(header->magic)) != 0 || header->version != PFS_INDEX_VERSION ||
+        header->archiveMtime != (uint64_t)st.st_mtime || header->archiveSize != (uint64_t)st.st_size)
+    {
+        munmap(index, indexLen);
+        return pfs_open_ex(outPfs, path, flags);
+    }
     
-    pfs->count = index + 1;
+    /* Directory only: no chains walked, no names inflated; the sidecar supplies both */
+    rc = pfs_open_ex(outPfs, path, flags | PFS_OPEN_LAZY | PFS_OPEN_DIRECTORY_ONLY);
     
-    return ent;
+    if (rc == PFS_OK && (!(*outPfs)->namesPending || pfs_adopt_index(*outPfs, (const uint8_t*)index, indexLen) != PFS_OK))
+    {
+        pfs_close(*outPfs);
+        rc = pfs_open_ex(outPfs, path, flags);
+    }
+    
+    munmap(index, indexLen);
+    return rc;
+}
+#else
+int pfs_write_index(PFS* pfs, const char* path, const char* indexPath)
+{
+    (void)pfs;
+    (void)path;
+    (void)indexPath;
+    return PFS_FILE_ERROR;
 }
 
-int pfs_insert_file(PFS* pfs, const char* name, const void* data, uint32_t length)
+int pfs_open_indexed(PFS** outPfs, const char* path, const char* indexPath, int flags)
 {
-    PfsEntry* ent;
+    (void)indexPath;
+    return pfs_open_ex(outPfs, path, flags);
+}
+#endif
+
+typedef struct {
+    PFS*        pfs;
+    int         priority;
+    uint32_t    seq;        /* Mount order, later wins among equal priorities */
+} PfsVfsMount;
+
+typedef struct {
+    uint32_t    hash;
+    uint32_t    mount;      /* Index into mounts + 1, 0 = empty */
+    uint32_t    index;      /* Entry in that mount's handle */
+} PfsVfsSlot;
+
+struct PfsVfs {
+    PfsVfsMount*    mounts;
+    uint32_t        mountCount;
+    uint32_t        mountCap;
+    uint32_t        seq;
+    PfsVfsSlot*     slots;
+    uint32_t        slotCount;  /* Always zero or a power of 2 */
+    uint32_t        used;       /* Distinct names visible */
+};
+
+int pfs_vfs_create(PfsVfs** outVfs)
+{
+    PfsVfs* vfs;
     
-    if (!pfs || !name || *name == 0 || !data || !length)
-        return PFS_MISUSE;
+    if (!outVfs) return PFS_MISUSE;
     
-    ent = pfs_get_or_append_entry(pfs, name);
-    if (!ent) return PFS_OUT_OF_MEMORY;
+    vfs = (PfsVfs*)pfs_calloc(1, sizeof(PfsVfs));
+    if (!vfs) return PFS_OUT_OF_MEMORY;
     
-    if (ent->inserted && ent->insertedIsCopy)
+    *outVfs = vfs;
+    return PFS_OK;
+}
+
+void pfs_vfs_destroy(PfsVfs* vfs)
+{
+    if (vfs)
     {
-        free(ent->inserted);
-        ent->inserted = NULL;
+        pfs_free_if_exists(vfs->mounts);
+        pfs_free_if_exists(vfs->slots);
+        pfs_free(vfs);
     }
-    
-    return pfs_compress(ent, data, length);
 }
 
-static int pfs_dupe_impl(PFS* dst, PFS* src, const char* name, int isCopy)
+/* Does mount a shadow mount b? */
+static int pfs_vfs_outranks(const PfsVfsMount* a, const PfsVfsMount* b)
 {
-    PfsEntry* ent;
-    PfsEntry* srcEnt;
-    uint8_t* data;
-    
-    if (!dst || !src || !name || *name == 0)
-        return PFS_MISUSE;
+    return (a->priority != b->priority) ? (a->priority > b->priority) : (a->seq > b->seq);
+}
+
+static PfsVfsSlot* pfs_vfs_probe(PfsVfs* vfs, const char* name, uint32_t hash)
+{
+    uint32_t mask = vfs->slotCount - 1;
+    uint32_t i = hash & mask;
     
-    srcEnt = pfs_get_entry(src, name);
-    if (!srcEnt) return PFS_NOT_FOUND;
+    for (;;)
+    {
+        PfsVfsSlot* slot = &vfs->slots[i];
+        
+        if (slot->mount == 0)
+            return slot;
+        
+        if (slot->hash == hash && strcmp(vfs->mounts[slot->mount - 1].pfs->entries[slot->index].name, name) == 0)
+            return slot;
+        
+        i = (i + 1) & mask;
+    }
+}
+
+/* Adds every name of one mount, taking over names from mounts it outranks */
+static void pfs_vfs_insert_mount(PfsVfs* vfs, uint32_t m)
+{
+    PfsVfsMount* mount = &vfs->mounts[m];
+    PFS* pfs = mount->pfs;
+    uint32_t i;
     
-    ent = pfs_get_or_append_entry(dst, name);
-    if (!ent) return PFS_OUT_OF_MEMORY;
+    /* Hashed by name CRC, as the handles' own indexes */
+    for (i = 0; i < pfs->count; i++)
+    {
+        uint32_t hash = pfs->entries[i].crc;
+        PfsVfsSlot* slot = pfs_vfs_probe(vfs, pfs->entries[i].name, hash);
+        
+        if (slot->mount == 0)
+            vfs->used++;
+        else if (!pfs_vfs_outranks(mount, &vfs->mounts[slot->mount - 1]))
+            continue;
+        
+        slot->hash = hash;
+        slot->mount = m + 1;
+        slot->index = i;
+    }
+}
+
+/*
+** Rebuilds the index from scratch, dropping mount skip first if it is in range. Sized for every name of every mount
+** at no more than half load, duplicates counted as distinct. Nothing changes if the allocation fails.
+*/
+static int pfs_vfs_reindex(PfsVfs* vfs, uint32_t skip)
+{
+    PfsVfsSlot* slots;
+    uint32_t total = 0;
+    uint32_t cap, i;
     
-    if (ent->inserted && ent->insertedIsCopy)
+    for (i = 0; i < vfs->mountCount; i++)
     {
-        free(ent->inserted);
-        ent->inserted = NULL;
+        if (i != skip)
+            total += vfs->mounts[i].pfs->count;
     }
     
-    ent->inflatedLen = srcEnt->inflatedLen;
-    ent->deflatedLen = srcEnt->deflatedLen;
+    cap = pfs_pow2_greater_or_equal(total * 2 + 2);
     
-    data = (srcEnt->inserted) ? srcEnt->inserted : (src->data + srcEnt->offset);
+    slots = (PfsVfsSlot*)pfs_calloc(cap, sizeof(PfsVfsSlot));
+    if (!slots) return PFS_OUT_OF_MEMORY;
     
-    if (isCopy)
+    if (skip < vfs->mountCount)
     {
-        uint8_t* copy = (uint8_t*)malloc(srcEnt->deflatedLen);
-        
-        if (!copy) return PFS_OUT_OF_MEMORY;
-        
-        memcpy(copy, data, srcEnt->deflatedLen);
-        
-        ent->insertedIsCopy = 1;
-        ent->inserted = copy;
+        vfs->mountCount--;
+        memmove(&vfs->mounts[skip], &vfs->mounts[skip + 1], sizeof(PfsVfsMount) * (vfs->mountCount - skip));
     }
-    else
+    
+    pfs_free_if_exists(vfs->slots);
+    vfs->slots = slots;
+    vfs->slotCount = cap;
+    vfs->used = 0;
+    
+    for (i = 0; i < vfs->mountCount; i++)
     {
-        ent->insertedIsCopy = 0;
-        ent->inserted = data;
+        pfs_vfs_insert_mount(vfs, i);
     }
     
     return PFS_OK;
 }
 
-int pfs_fast_file_duplicate(PFS* dst, PFS* src, const char* name)
-{
-    return pfs_dupe_impl(dst, src, name, 1);
-}
-
-int pfs_fast_file_duplicate_no_copy(PFS* dst, PFS* src, const char* name)
+int pfs_vfs_rebuild(PfsVfs* vfs)
 {
-    return pfs_dupe_impl(dst, src, name, 0);
+    uint32_t i;
+    int rc;
+    
+    if (!vfs) return PFS_MISUSE;
+    
+    for (i = 0; i < vfs->mountCount; i++)
+    {
+        rc = pfs_require_names(vfs->mounts[i].pfs);
+        if (rc) return rc;
+    }
+    
+    return pfs_vfs_reindex(vfs, vfs->mountCount);
 }
 
-int pfs_remove_file(PFS* pfs, const char* name)
+int pfs_vfs_mount(PfsVfs* vfs, PFS* pfs, int priority)
 {
-    int index;
-    PfsEntry* ent;
-    uint32_t n;
+    PfsVfsMount* mount;
+    uint32_t i;
+    int rc;
     
-    if (!pfs || !name)
+    if (!vfs || !pfs)
         return PFS_MISUSE;
     
-    index = pfs_file_index_by_name(pfs, name);
-    if (index < 0) return index;
-    
-    ent = &pfs->entries[index];
-    
-    if (ent->name && ent->nameIsCopy)
+    for (i = 0; i < vfs->mountCount; i++)
     {
-        free(ent->name);
-        ent->name = NULL;
+        if (vfs->mounts[i].pfs == pfs)
+            return PFS_MISUSE;
     }
     
-    if (ent->inserted)
+    /* The merged index points at names, which PFS_OPEN_DIRECTORY_ONLY handles don't have yet */
+    rc = pfs_require_names(pfs);
+    if (rc) return rc;
+    
+    if (vfs->mountCount == vfs->mountCap)
     {
-        free(ent->inserted);
-        ent->inserted = NULL;
+        uint32_t cap = (vfs->mountCap) ? vfs->mountCap * 2 : 8;
+        
+        mount = (PfsVfsMount*)pfs_realloc(vfs->mounts, sizeof(PfsVfsMount) * cap);
+        if (!mount) return PFS_OUT_OF_MEMORY;
+        
+        vfs->mounts = mount;
+        vfs->mountCap = cap;
     }
     
-    /* Swap and pop */
-    n = pfs->count - 1;
-    pfs->count = n;
+    mount = &vfs->mounts[vfs->mountCount];
+    mount->pfs = pfs;
+    mount->priority = priority;
+    mount->seq = vfs->seq++;
     
-    pfs->entries[index] = pfs->entries[n];
-    pfs->hashes[index] = pfs->hashes[n];
+    vfs->mountCount++;
+    
+    /* Grow by rebuilding, otherwise only the new names need to go in */
+    if ((vfs->used + pfs->count) * 2 >= vfs->slotCount)
+    {
+        rc = pfs_vfs_reindex(vfs, vfs->mountCount);
+        if (rc) vfs->mountCount--;
+        return rc;
+    }
     
+    pfs_vfs_insert_mount(vfs, vfs->mountCount - 1);
     return PFS_OK;
 }
 
-const char* pfs_file_name(PFS* pfs, uint32_t index)
+/* Names the unmounted handle shadowed have to come back from the others, so this rebuilds the index */
+int pfs_vfs_unmount(PfsVfs* vfs, PFS* pfs)
 {
-    const char* name = NULL;
+    uint32_t i;
     
-    if (pfs && index < pfs->count)
-        name = pfs->entries[index].name;
+    if (!vfs || !pfs)
+        return PFS_MISUSE;
     
-    return name;
-}
-
-uint32_t pfs_file_size(PFS* pfs, uint32_t index)
-{
-    uint32_t size = 0;
+    for (i = 0; i < vfs->mountCount; i++)
+    {
+        if (vfs->mounts[i].pfs == pfs)
+            break;
+    }
     
-    if (pfs && index < pfs->count)
-        size = pfs->entries[index].inflatedLen;
+    if (i == vfs->mountCount)
+        return PFS_NOT_FOUND;
     
-    return size;
+    return pfs_vfs_reindex(vfs, i);
 }
 
-uint32_t pfs_file_size_compressed(PFS* pfs, uint32_t index)
+int pfs_vfs_find(PfsVfs* vfs, const char* name, PFS** outPfs, uint32_t* outIndex)
 {
-    uint32_t size = 0;
+    PfsVfsSlot* slot;
     
-    if (pfs && index < pfs->count)
-        size = pfs->entries[index].deflatedLen;
+    if (!vfs || !name || !outPfs || !outIndex)
+        return PFS_MISUSE;
     
-    return size;
+    if (vfs->slotCount == 0)
+        return PFS_NOT_FOUND;
+    
+    slot = pfs_vfs_probe(vfs, name, pfs_crc(name, strlen(name) + 1)); /* CRC includes the null terminator */
+    
+    if (slot->mount == 0)
+        return PFS_NOT_FOUND;
+    
+    *outPfs = vfs->mounts[slot->mount - 1].pfs;
+    *outIndex = slot->index;
+    return PFS_OK;
 }
 
-int pfs_file_data(PFS* pfs, const char* name, uint8_t** data, uint32_t* length)
+int pfs_vfs_file_data(PfsVfs* vfs, const char* name, uint8_t** data, uint32_t* length)
 {
-    int index;
+    PFS* pfs;
+    uint32_t index;
+    PfsInflater local;
+    PfsInflater* inf;
+    int rc;
     
-    if (!pfs || !name || !data || !length)
+    if (!data || !length)
         return PFS_MISUSE;
     
-    index = pfs_file_index_by_name(pfs, name);
-    if (index < 0) return index;
+    rc = pfs_vfs_find(vfs, name, &pfs, &index);
+    if (rc) return rc;
+    
+    inf = pfs_inflater_acquire(pfs, &local);
+    rc = pfs_decompress_index(pfs, inf, data, length, index);
+    pfs_inflater_return(pfs, inf, &local);
     
-    return pfs_decompress_index(pfs, data, length, (uint32_t)index);
+    return rc;
+}
+
+uint32_t pfs_vfs_file_count(PfsVfs* vfs)
+{
+    return (vfs) ? vfs->used : 0;
 }
@@ -2,6 +2,7 @@
 #ifndef PFS_H
 #define PFS_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #define PFS_OK 0
@@ -12,6 +13,41 @@
 #define PFS_MISUSE -5
 #define PFS_CORRUPTED -6
 #define PFS_OUT_OF_BOUNDS -7
+#define PFS_READ_ONLY -8
+
+/* Flags for pfs_open_ex() */
+#define PFS_OPEN_MMAP 0x01 /* Map the archive read-only instead of reading it into memory; ignored on Windows */
+#define PFS_OPEN_LAZY 0x02 /* Only read the directory and names at open; each entry's block chain is validated on first use */
+#define PFS_OPEN_NO_COPY 0x04 /* pfs_open_from_memory_ex() only: use the caller's buffer directly, it must outlive the handle */
+/*
+** Look files up by the on-disk CRC directory; names are only inflated when enumerated or modified. Until then a lookup
+** matches on the CRC-32 of the name alone, so a name that is not in the archive but shares the CRC of one that is
+** finds that entry, with odds of about count in 2^32 per miss. CRCs shared by several entries are resolved by name.
+*/
+#define PFS_OPEN_DIRECTORY_ONLY 0x08
+/*
+** Nothing may change the archive (PFS_READ_ONLY). In exchange, lookups, enumeration, sizes, pfs_file_data*(),
+** streams and the cache are safe from any number of threads at once; only the cache and the one-time name load of
+** PFS_OPEN_DIRECTORY_ONLY take a lock. Writing the archive out and the pfs_set_*() calls are not, and not on Windows.
+** Without the flag, lookups, sizes and pfs_file_data(), _into(), _parallel() and _many() may still run on several
+** threads while nothing modifies the handle; enumeration of PFS_OPEN_DIRECTORY_ONLY handles and the cache may not.
+*/
+#define PFS_OPEN_READ_ONLY 0x10
+
+/* Compression levels, as in zlib */
+#define PFS_LEVEL_ADAPTIVE -2 /* Per block: stored if the data looks incompressible, otherwise PFS_LEVEL_BEST */
+#define PFS_LEVEL_DEFAULT -1 /* pfs_insert_file_ex() only: use the extension's or the archive's level */
+#define PFS_LEVEL_STORE 0 /* Stored blocks, written without going through deflate: packing runs at copy speed */
+#define PFS_LEVEL_FASTEST 1
+#define PFS_LEVEL_BEST 9
+
+/* Entries are compressed in independent blocks of this many bytes; the original client always writes 8192 */
+#define PFS_BLOCK_SIZE_DEFAULT 8192
+#define PFS_BLOCK_SIZE_MIN 512
+#define PFS_BLOCK_SIZE_MAX 65536
+
+/* Entries, and pfs_file_data_many() batches, smaller than this are inflated on the calling thread */
+#define PFS_PARALLEL_MIN_SIZE (1024 * 1024)
 
 #ifdef _WIN32
 # ifdef __cplusplus
@@ -24,18 +60,138 @@
 #endif
 
 typedef struct PFS PFS;
+typedef struct PfsInflater PfsInflater;
+typedef struct PfsStream PfsStream;
+typedef struct PfsVfs PfsVfs;
+
+/* Receives the archive in order, one piece at a time; return non-zero to abort the write */
+typedef int (*PfsWriteFn)(void* userdata, const void* data, uint32_t length);
+
+typedef struct {
+    uint64_t    hits;
+    uint64_t    misses;
+    uint64_t    evictions;
+    uint32_t    bytes;  /* Inflated bytes currently held by the cache */
+    uint32_t    count;
+} PfsCacheStats;
+
+/* Cumulative since the handle was opened or the counters were reset; see pfs_get_stats() */
+typedef struct {
+    uint64_t    lookups;
+    uint64_t    lookupMisses;
+    uint64_t    probes;         /* Hash slots examined by lookups */
+    uint64_t    blocksInflated;
+    uint64_t    bytesInflated;
+    uint64_t    inflateNs;
+    uint64_t    blocksDeflated;
+    uint64_t    bytesDeflated;  /* Input bytes */
+    uint64_t    deflateNs;
+    uint64_t    allocations;    /* Entry sized buffers: archive images, inflated and compressed data */
+    uint64_t    allocatedBytes;
+    uint64_t    bytesRead;      /* Archive files read into memory; mapped files don't count */
+    uint64_t    bytesWritten;   /* Archive files written */
+    uint64_t    ioNs;
+} PfsStats;
+
+#define PFS_TRACE_OPEN 1
+#define PFS_TRACE_READ 2
+#define PFS_TRACE_INSERT 3
+#define PFS_TRACE_WRITE 4
+
+/* name is the path or entry name, or NULL for memory; bytes is the archive, entry or data size, 0 on failure */
+typedef void (*PfsTraceFn)(void* userdata, int op, const char* name, uint32_t bytes, uint64_t ns, int rc);
+
+/* Same contracts as malloc(), realloc() and free(), NULL included; see pfs_set_allocator() */
+typedef void* (*PfsMallocFn)(void* userdata, size_t size);
+typedef void* (*PfsReallocFn)(void* userdata, void* ptr, size_t size);
+typedef void (*PfsFreeFn)(void* userdata, void* ptr);
 
 PFS_API int pfs_open(PFS** pfs, const char* path);
+PFS_API int pfs_open_ex(PFS** pfs, const char* path, int flags);
+PFS_API int pfs_open_mmap(PFS** pfs, const char* path);
 PFS_API int pfs_open_from_memory(PFS** pfs, const void* data, uint32_t length);
+PFS_API int pfs_open_from_memory_ex(PFS** pfs, const void* data, uint32_t length, int flags);
 PFS_API int pfs_open_from_memory_no_copy(PFS** pfs, const void* data, uint32_t length);
 PFS_API int pfs_create_new(PFS** pfs);
 PFS_API void pfs_close(PFS* pfs);
 
+/*
+** Sidecar index for fast cold opens: pfs_write_index() records what opening the archive at path works out (entry
+** table, block chain lengths, names and hash index) in a file that pfs_open_indexed() maps and checks instead of
+** parsing. It is keyed on the archive's size, mtime and directory checksum; a missing, stale or damaged sidecar just
+** means a normal open. The handle must be unmodified since it was opened from or saved to path. Not on Windows.
+*/
+PFS_API int pfs_write_index(PFS* pfs, const char* path, const char* indexPath);
+PFS_API int pfs_open_indexed(PFS** pfs, const char* path, const char* indexPath, int flags);
+
+/*
+** Selects the inflate backend by name for the whole process: "zlib", or "libdeflate" when built with
+** PFS_USE_LIBDEFLATE, which is then the default. NULL restores the default. Call before any handle is in use.
+** Every backend reads and writes the same zlib streams.
+*/
+PFS_API int pfs_set_codec(const char* name);
+PFS_API const char* pfs_codec_name(void);
+
+/*
+** Routes every allocation of the library, zlib's and libdeflate's state included, through these hooks for the
+** whole process. Pass all three or none; NULLs restore the C library's. Set them before anything is allocated and
+** keep them until it is all freed: buffers from pfs_file_data(), pfs_file_data_parallel(), pfs_file_data_many() and
+** pfs_compress_data() go back through pfs_file_data_free(), not free(). Names of appended entries live in a per-handle
+** arena that pfs_close() frees in one go, so removing entries doesn't give their names back before then.
+** Built with PFS_USE_LIBDEFLATE, this also calls libdeflate_set_memory_allocator(), which is global to libdeflate:
+** any other libdeflate user in the process then allocates through these hooks too, and can take them back by
+** setting its own, which also takes them from pfs.
+*/
+PFS_API int pfs_set_allocator(PfsMallocFn mallocFn, PfsReallocFn reallocFn, PfsFreeFn freeFn, void* userdata);
+
+/*
+** Counters for one handle, or for the whole process with a NULL pfs. Cheap enough to leave on; building with
+** PFS_NO_STATS removes them, and then they read as zero. pfs_set_trace() reports every open, read, insert and write
+** call with its latency, from whichever thread made it; set it before any handle is in use, NULL turns it off.
+*/
+PFS_API int pfs_get_stats(PFS* pfs, PfsStats* stats);
+PFS_API void pfs_reset_stats(PFS* pfs);
+PFS_API void pfs_set_trace(PfsTraceFn fn, void* userdata);
+
 PFS_API uint32_t pfs_file_count(PFS* pfs);
 
+/* Replaces path atomically, via a temporary file beside it */
 PFS_API int pfs_write_to_disk(PFS* pfs, const char* path);
+/* If capacity is too small, returns PFS_OUT_OF_BOUNDS with the size needed in length */
+PFS_API int pfs_write_to_memory(PFS* pfs, void* buf, uint32_t capacity, uint32_t* length);
+PFS_API int pfs_write_to_callback(PFS* pfs, PfsWriteFn write, void* userdata);
+/* Entries with identical compressed data are stored once; this is how many bytes the last write saved that way */
+PFS_API uint32_t pfs_deduplicated_bytes(PFS* pfs);
+
+/*
+** Saves by appending only what changed to the archive this handle was opened from or last saved to disk as, and
+** writes nothing if nothing did. Falls back to pfs_write_to_disk() if path holds anything else. pfs_compact() saves
+** the same way, except that it rewrites the archive in full once more than maxWastePercent of it is unreferenced, as
+** reported by pfs_wasted_bytes(); either way every change is on disk when it returns PFS_OK.
+*/
+PFS_API int pfs_save_incremental(PFS* pfs, const char* path);
+PFS_API int pfs_compact(PFS* pfs, const char* path, uint32_t maxWastePercent);
+PFS_API uint32_t pfs_wasted_bytes(PFS* pfs);
 
 PFS_API int pfs_insert_file(PFS* pfs, const char* name, const void* data, uint32_t length);
+PFS_API int pfs_insert_file_ex(PFS* pfs, const char* name, const void* data, uint32_t length, int level, uint32_t blockSize);
+/*
+** Compresses on nthreads threads (0 = one per CPU), then adds the entries in order; same result as pfs_insert_file()
+** on each. Traces one PFS_TRACE_INSERT per entry added, timed by its compression, plus one for the entry it stopped at.
+*/
+PFS_API int pfs_insert_files(PFS* pfs, const char* const* names, const void* const* datas, const uint32_t* lengths, uint32_t count, uint32_t nthreads);
+/*
+** Adds an entry from an already compressed block chain, as built by pfs_compress_data() or read from another archive.
+** The chain is checked for consistency but not inflated. pfs_compress_data()'s result is freed with pfs_file_data_free().
+*/
+PFS_API int pfs_insert_compressed(PFS* pfs, const char* name, const void* data, uint32_t length);
+PFS_API int pfs_compress_data(PFS* pfs, const void* data, uint32_t length, int level, uint32_t blockSize, uint8_t** compressed, uint32_t* compressedLength);
+PFS_API int pfs_set_compression_level(PFS* pfs, int level);
+PFS_API int pfs_set_block_size(PFS* pfs, uint32_t blockSize);
+/* Overrides the archive's level for names ending in .ext (case-insensitive); PFS_LEVEL_DEFAULT removes the override */
+PFS_API int pfs_set_extension_level(PFS* pfs, const char* ext, int level);
+/* The level an entry was compressed at by this handle, the majority one for adaptive entries; PFS_LEVEL_DEFAULT if unknown */
+PFS_API int pfs_file_compression_level(PFS* pfs, const char* name, int* level);
 PFS_API int pfs_fast_file_duplicate(PFS* dst, PFS* src, const char* name);
 PFS_API int pfs_fast_file_duplicate_no_copy(PFS* dst, PFS* src, const char* name);
 
@@ -44,7 +200,66 @@ PFS_API int pfs_remove_file(PFS* pfs, const char* name);
 PFS_API const char* pfs_file_name(PFS* pfs, uint32_t index);
 PFS_API uint32_t pfs_file_size(PFS* pfs, uint32_t index);
 PFS_API uint32_t pfs_file_size_compressed(PFS* pfs, uint32_t index);
+PFS_API uint32_t pfs_file_size_by_name(PFS* pfs, const char* name);
 
 PFS_API int pfs_file_data(PFS* pfs, const char* name, uint8_t** data, uint32_t* length);
+PFS_API void pfs_file_data_free(void* data);
+
+/* Inflates into the caller's buffer; if capacity is too small, returns PFS_OUT_OF_BOUNDS with the size needed in length */
+PFS_API int pfs_file_data_into(PFS* pfs, const char* name, void* buf, uint32_t capacity, uint32_t* length);
+
+/*
+** An inflater may be used with any handle, but only by one thread at a time; pfs_file_data() takes a free one from the
+** handle's pool.
+*/
+PFS_API int pfs_inflater_create(PfsInflater** inf);
+PFS_API void pfs_inflater_destroy(PfsInflater* inf);
+PFS_API int pfs_file_data_with_inflater(PFS* pfs, PfsInflater* inf, const char* name, uint8_t** data, uint32_t* length);
+
+/*
+** Cached, zero-copy reads: the handle keeps up to budget bytes of inflated entries, least recently used evicted first.
+** The budget is 0 (nothing kept) until set. Every buffer from pfs_file_data_shared() must be passed to
+** pfs_file_data_release(); it stays valid until then, even across eviction, modification or pfs_close().
+*/
+PFS_API int pfs_set_cache_budget(PFS* pfs, uint32_t bytes);
+PFS_API int pfs_file_data_shared(PFS* pfs, const char* name, const uint8_t** data, uint32_t* length);
+PFS_API void pfs_file_data_release(const uint8_t* data);
+PFS_API void pfs_cache_stats(PFS* pfs, PfsCacheStats* stats);
+
+/*
+** Random access to one entry, inflating only the blocks covering each read; at most one block is held in memory.
+** The stream reads the handle's data directly: close it before closing the handle or changing that entry.
+*/
+PFS_API int pfs_stream_open(PfsStream** stream, PFS* pfs, const char* name);
+PFS_API int pfs_stream_read(PfsStream* stream, void* buf, uint32_t length, uint32_t* read);
+PFS_API int pfs_stream_seek(PfsStream* stream, uint32_t offset);
+PFS_API uint32_t pfs_stream_tell(PfsStream* stream);
+PFS_API uint32_t pfs_stream_size(PfsStream* stream);
+PFS_API void pfs_stream_close(PfsStream* stream);
+
+/* Inflates the blocks of one large entry on nthreads threads (0 = one per CPU) */
+PFS_API int pfs_file_data_parallel(PFS* pfs, const char* name, uint8_t** data, uint32_t* length, uint32_t nthreads);
+/*
+** Looks up count entries, then reads them in archive order: datas[i] and lengths[i] get names[i]'s data, or NULL and 0,
+** and rcs[i] its status. Entries go to nthreads threads (0 = one per CPU) once the batch is large enough; a mapped
+** archive is asked for the batch's pages up front. Returns the first failure in names order, or PFS_OK.
+*/
+PFS_API int pfs_file_data_many(PFS* pfs, const char* const* names, uint32_t count, uint8_t** datas, uint32_t* lengths, int* rcs, uint32_t nthreads);
+
+/*
+** Overlay of many archives behind one merged hash index: a name resolves to (archive, entry index) in one probe.
+** Higher priority mounts shadow lower ones, and among equal priorities the later mount wins. The vfs doesn't own the
+** handles. Mounted handles must not change; after changing one, call pfs_vfs_rebuild(). Unmounting rebuilds too.
+** pfs_vfs_find() is safe from several threads while nothing is mounted or unmounted; pfs_vfs_file_data() is as safe
+** as pfs_file_data() on the handle holding the entry.
+*/
+PFS_API int pfs_vfs_create(PfsVfs** vfs);
+PFS_API void pfs_vfs_destroy(PfsVfs* vfs);
+PFS_API int pfs_vfs_mount(PfsVfs* vfs, PFS* pfs, int priority);
+PFS_API int pfs_vfs_unmount(PfsVfs* vfs, PFS* pfs);
+PFS_API int pfs_vfs_rebuild(PfsVfs* vfs);
+PFS_API int pfs_vfs_find(PfsVfs* vfs, const char* name, PFS** pfs, uint32_t* index);
+PFS_API int pfs_vfs_file_data(PfsVfs* vfs, const char* name, uint8_t** data, uint32_t* length);
+PFS_API uint32_t pfs_vfs_file_count(PfsVfs* vfs);
 
 #endif/*PFS_H*/
@@ -0,0 +1,512 @@
+/*
+** Microbenchmarks over synthetic archives. The generator is deterministic for a given seed and settings, so two builds
+** run against the same archive contents. Results are written one CSV row per benchmark to stdout.
+*/
+
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 199309L
+#endif
+
+#include "pfs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include <errno.h>
+#include <limits.h>
+
+typedef struct {
+    uint32_t    fileCount;
+    uint32_t    meanSize;       /* Sizes are drawn log-uniformly between meanSize / 16 and meanSize * 4 */
+    uint32_t    compressibility;/* 0 (random bytes) to 100 (only words from a 12-word dictionary) */
+    uint32_t    nameLength;
+    uint32_t    seed;
+    uint32_t    iterations;
+    int         level;
+    const char* path;
+} BenchConfig;
+
+typedef struct {
+    char**      names;
+    uint8_t**   datas;
+    uint32_t*   lengths;
+    uint64_t    totalBytes;
+    uint32_t    count;
+} BenchSet;
+
+static uint32_t bench_rng;
+
+static uint32_t bench_rand(void)
+{
+    /* xorshift32 */
+    uint32_t x = bench_rng;
+    
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    bench_rng = x;
+    return x;
+}
+
+static double bench_now(void)
+{
+#ifdef _WIN32
+    return (double)clock() / CLOCKS_PER_SEC;
+#else
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+#endif
+}
+
+static uint32_t bench_size(const BenchConfig* cfg)
+{
+    double lo = cfg->meanSize / 16.0;
+    double hi = cfg->meanSize * 4.0;
+    double t = (double)(bench_rand() & 0xffff) / 65535.0;
+    uint32_t size;
+    
+    if (lo < 1.0)
+        lo = 1.0;
+    
+    size = (uint32_t)(lo * exp(log(hi / lo) * t));
+    return size ? size : 1;
+}
+
+static void bench_fill(const BenchConfig* cfg, uint8_t* data, uint32_t length)
+{
+    static const char* words[] = {
+        "texture", "model", "zone", "sound", "bitmap", "mesh", "light", "anim", "actor", "region", "spell", "terrain"
+    };
+    uint32_t i = 0;
+    
+    /* Runs of dictionary words for the compressible share, random bytes for the rest */
+    while (i < length)
+    {
+        if (bench_rand() % 100 < cfg->compressibility)
+        {
+            const char* w = words[bench_rand() % (sizeof(words) / sizeof(words[0]))];
+            
+            while (*w && i < length)
+            {
+                data[i++] = (uint8_t)*w++;
+            }
+            
+            if (i < length)
+                data[i++] = ' ';
+        }
+        else
+        {
+            uint32_t run = 1 + bench_rand() % 8;
+            
+            while (run-- && i < length)
+            {
+                data[i++] = (uint8_t)bench_rand();
+            }
+        }
+    }
+}
+
+static void bench_name(const BenchConfig* cfg, uint32_t index, char* name)
+{
+    static const char alphabet[] = "abcdefghijklmnopqrstuvwxyz0123456789_";
+    uint32_t len = (uint32_t)sprintf(name, "%u_", index);
+    
+    while (len < cfg->nameLength)
+    {
+        name[len++] = alphabet[bench_rand() % (sizeof(alphabet) - 1)];
+    }
+    
+    strcpy(name + len, ".dat");
+}
+
+static int bench_generate(const BenchConfig* cfg, BenchSet* set)
+{
+    uint32_t i;
+    
+    bench_rng = cfg->seed ? cfg->seed : 1;
+    
+    set->count = cfg->fileCount;
+    set->totalBytes = 0;
+    set->names = (char**)calloc(set->count, sizeof(char*));
+    set->datas = (uint8_t**)calloc(set->count, sizeof(uint8_t*));
+    set->lengths = (uint32_t*)calloc(set->count, sizeof(uint32_t));
+    
+    if (!set->names || !set->datas || !set->lengths)
+        return PFS_OUT_OF_MEMORY;
+    
+    for (i = 0; i < set->count; i++)
+    {
+        uint32_t length = bench_size(cfg);
+        
+        set->names[i] = (char*)malloc(cfg->nameLength + 16);
+        set->datas[i] = (uint8_t*)malloc(length);
+        
+        if (!set->names[i] || !set->datas[i])
+            return PFS_OUT_OF_MEMORY;
+        
+        bench_name(cfg, i, set->names[i]);
+        bench_fill(cfg, set->datas[i], length);
+        set->lengths[i] = length;
+        set->totalBytes += length;
+    }
+    
+    return PFS_OK;
+}
+
+static void bench_free(BenchSet* set)
+{
+    uint32_t i;
+    
+    for (i = 0; i < set->count; i++)
+    {
+        if (set->names) free(set->names[i]);
+        if (set->datas) free(set->datas[i]);
+    }
+    
+    free(set->names);
+    free(set->datas);
+    free(set->lengths);
+}
+
+static void bench_report(const char* name, uint32_t iterations, uint64_t ops, uint64_t bytes, double seconds)
+{
+    double perOp = ops ? seconds * 1e9 / (double)ops : 0.0;
+    double mbps = seconds > 0.0 ? (double)bytes / (1024.0 * 1024.0) / seconds : 0.0;
+    
+    printf("%s,%u,%lu,%lu,%.6f,%.1f,%.2f\n", name, iterations, (unsigned long)ops, (unsigned long)bytes, seconds, perOp, mbps);
+    fflush(stdout);
+}
+
+#define BENCH_BATCH 64
+
+#define bench_check(expr) do { int rc_ = (expr); if (rc_) { fprintf(stderr, "%s failed: %d\n", #expr, rc_); goto fail; } } while(0)
+
+static int bench_run(const BenchConfig* cfg, BenchSet* set)
+{
+    PFS* pfs = NULL;
+    uint8_t* image = NULL;
+    uint32_t* order = NULL;
+    const char* batchNames[BENCH_BATCH];
+    uint8_t* batchDatas[BENCH_BATCH];
+    uint32_t batchLengths[BENCH_BATCH];
+    int batchRcs[BENCH_BATCH];
+    uint32_t imageLength = 0;
+    uint32_t it, i;
+    uint64_t ops, bytes;
+    double start, elapsed;
+    FILE* fp;
+    
+    /* pfs_insert_file: builds the archive that every later benchmark reads */
+    start = bench_now();
+    
+    for (it = 0; it < cfg->iterations; it++)
+    {
+        if (pfs) pfs_close(pfs);
+        
+        bench_check(pfs_create_new(&pfs));
+        bench_check(pfs_set_compression_level(pfs, cfg->level));
+        
+        for (i = 0; i < set->count; i++)
+        {
+            bench_check(pfs_insert_file(pfs, set->names[i], set->datas[i], set->lengths[i]));
+        }
+    }
+    
+    bench_report("insert_file", cfg->iterations, (uint64_t)set->count * cfg->iterations, set->totalBytes * cfg->iterations,
+        bench_now() - start);
+    
+    /* pfs_write_to_disk */
+    start = bench_now();
+    
+    for (it = 0; it < cfg->iterations; it++)
+    {
+        bench_check(pfs_write_to_disk(pfs, cfg->path));
+    }
+    
+    elapsed = bench_now() - start;
+    pfs_close(pfs);
+    pfs = NULL;
+    
+    fp = fopen(cfg->path, "rb");
+    if (!fp) goto fail;
+    
+    fseek(fp, 0, SEEK_END);
+    imageLength = (uint32_t)ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    image = (uint8_t*)malloc(imageLength);
+    
+    if (!image || fread(image, imageLength, 1, fp) != 1)
+    {
+        fclose(fp);
+        goto fail;
+    }
+    
+    fclose(fp);
+    
+    bench_report("write_to_disk", cfg->iterations, cfg->iterations, (uint64_t)imageLength * cfg->iterations, elapsed);
+    
+    /* pfs_open: reading the file, walking the block chains and inflating the names */
+    start = bench_now();
+    
+    for (it = 0; it < cfg->iterations; it++)
+    {
+        bench_check(pfs_open(&pfs, cfg->path));
+        pfs_close(pfs);
+        pfs = NULL;
+    }
+    
+    bench_report("open", cfg->iterations, cfg->iterations, (uint64_t)imageLength * cfg->iterations, bench_now() - start);
+    
+    /* pfs_open_from_memory_no_copy: the same without the file I/O */
+    start = bench_now();
+    
+    for (it = 0; it < cfg->iterations; it++)
+    {
+        bench_check(pfs_open_from_memory_no_copy(&pfs, image, imageLength));
+        pfs_close(pfs);
+        pfs = NULL;
+    }
+    
+    bench_report("open_from_memory_no_copy", cfg->iterations, cfg->iterations, (uint64_t)imageLength * cfg->iterations,
+        bench_now() - start);
+    
+    bench_check(pfs_open_from_memory_no_copy(&pfs, image, imageLength));
+    
+    /* Lookups and reads go in a fixed shuffled order so neither favours the archive's layout */
+    order = (uint32_t*)malloc(sizeof(uint32_t) * (set->count ? set->count : 1));
+    if (!order) goto fail;
+    
+    bench_rng = cfg->seed ^ 0x9e3779b9;
+    if (!bench_rng) bench_rng = 1;
+    
+    for (i = 0; i < set->count; i++)
+    {
+        order[i] = i;
+    }
+    
+    for (i = set->count; i > 1; i--)
+    {
+        uint32_t k = bench_rand() % i;
+        uint32_t tmp = order[i - 1];
+        
+        order[i - 1] = order[k];
+        order[k] = tmp;
+    }
+    
+    /* pfs_file_size_by_name: name lookup without inflating anything */
+    start = bench_now();
+    ops = 0;
+    
+    for (it = 0; it < cfg->iterations * 10; it++)
+    {
+        for (i = 0; i < set->count; i++)
+        {
+            if (pfs_file_size_by_name(pfs, set->names[order[i]]) != set->lengths[order[i]])
+            {
+                fprintf(stderr, "lookup of %s failed\n", set->names[order[i]]);
+                goto fail;
+            }
+            
+            ops++;
+        }
+    }
+    
+    bench_report("lookup", cfg->iterations * 10, ops, 0, bench_now() - start);
+    
+    /* pfs_file_data: lookup plus inflate, MB/s of inflated output */
+    start = bench_now();
+    ops = 0;
+    bytes = 0;
+    
+    for (it = 0; it < cfg->iterations; it++)
+    {
+        for (i = 0; i < set->count; i++)
+        {
+            uint8_t* data;
+            uint32_t length;
+            
+            bench_check(pfs_file_data(pfs, set->names[order[i]], &data, &length));
+            pfs_file_data_free(data);
+            
+            ops++;
+            bytes += length;
+        }
+    }
+    
+    bench_report("file_data", cfg->iterations, ops, bytes, bench_now() - start);
+    
+    /* pfs_file_data_many: the same reads in batches, which it sorts by archive offset */
+    start = bench_now();
+    ops = 0;
+    bytes = 0;
+    
+    for (it = 0; it < cfg->iterations; it++)
+    {
+        for (i = 0; i < set->count; i += BENCH_BATCH)
+        {
+            uint32_t n = (set->count - i < BENCH_BATCH) ? set->count - i : BENCH_BATCH;
+            uint32_t k;
+            
+            for (k = 0; k < n; k++)
+            {
+                batchNames[k] = set->names[order[i + k]];
+            }
+            
+            bench_check(pfs_file_data_many(pfs, batchNames, n, batchDatas, batchLengths, batchRcs, 0));
+            
+            for (k = 0; k < n; k++)
+            {
+                pfs_file_data_free(batchDatas[k]);
+                bytes += batchLengths[k];
+            }
+            
+            ops += n;
+        }
+    }
+    
+    bench_report("file_data_many", cfg->iterations, ops, bytes, bench_now() - start);
+    
+    pfs_close(pfs);
+    free(image);
+    free(order);
+    remove(cfg->path);
+    return 0;
+    
+fail:
+    if (pfs) pfs_close(pfs);
+    if (image) free(image);
+    if (order) free(order);
+    remove(cfg->path);
+    return 1;
+}
+
+/* Whole decimal numbers only: strtoul() alone takes "", "12abc" and "-1" */
+static int bench_parse_uint(const char* value, uint32_t* out)
+{
+    unsigned long v;
+    char* end;
+    
+    if (*value < '0' || *value > '9')
+        return 0;
+    
+    errno = 0;
+    v = strtoul(value, &end, 10);
+    
+    if (*end != 0 || errno == ERANGE || v > 0xffffffffUL)
+        return 0;
+    
+    *out = (uint32_t)v;
+    return 1;
+}
+
+static int bench_parse_int(const char* value, int* out)
+{
+    long v;
+    char* end;
+    
+    if (*value == 0)
+        return 0;
+    
+    errno = 0;
+    v = strtol(value, &end, 10);
+    
+    if (*end != 0 || errno == ERANGE || v < INT_MIN || v > INT_MAX)
+        return 0;
+    
+    *out = (int)v;
+    return 1;
+}
+
+static void bench_usage(const char* argv0)
+{
+    fprintf(stderr,
+        "usage: %s [options]\n"
+        "  -n count     files in the archive (default 2000)\n"
+        "  -s bytes     mean file size (default 16384)\n"
+        "  -c percent   share of dictionary words vs random bytes, 0-100 (default 70)\n"
+        "  -l length    file name length (default 24)\n"
+        "  -L level     compression level, 0-9 or -2 for adaptive (default 9)\n"
+        "  -i count     iterations (default 5)\n"
+        "  -S seed      generator seed (default 1)\n"
+        "  -o path      scratch archive (default pfs_bench.s3d)\n",
+        argv0);
+}
+
+int main(int argc, char** argv)
+{
+    BenchConfig cfg;
+    BenchSet set;
+    int i, ok, rc;
+    
+    cfg.fileCount = 2000;
+    cfg.meanSize = 16384;
+    cfg.compressibility = 70;
+    cfg.nameLength = 24;
+    cfg.seed = 1;
+    cfg.iterations = 5;
+    cfg.level = PFS_LEVEL_BEST;
+    cfg.path = "pfs_bench.s3d";
+    
+    for (i = 1; i < argc; i++)
+    {
+        const char* arg = argv[i];
+        const char* value = (i + 1 < argc) ? argv[i + 1] : NULL;
+        
+        if (arg[0] != '-' || arg[1] == 0 || arg[2] != 0 || !value)
+        {
+            bench_usage(argv[0]);
+            return 2;
+        }
+        
+        switch (arg[1])
+        {
+        case 'n': ok = bench_parse_uint(value, &cfg.fileCount); break;
+        case 's': ok = bench_parse_uint(value, &cfg.meanSize); break;
+        case 'c': ok = bench_parse_uint(value, &cfg.compressibility); break;
+        case 'l': ok = bench_parse_uint(value, &cfg.nameLength); break;
+        case 'L': ok = bench_parse_int(value, &cfg.level); break;
+        case 'i': ok = bench_parse_uint(value, &cfg.iterations); break;
+        case 'S': ok = bench_parse_uint(value, &cfg.seed); break;
+        case 'o': ok = 1; cfg.path = value; break;
+        default: ok = 0; break;
+        }
+        
+        if (!ok)
+        {
+            bench_usage(argv[0]);
+            return 2;
+        }
+        
+        i++;
+    }
+    
+    /* bench_size() takes the log of the size range and draws sizes up to four times the mean */
+    if (cfg.fileCount == 0 || cfg.meanSize == 0 || cfg.meanSize > 0xffffffffU / 4 || cfg.compressibility > 100 ||
+        cfg.iterations == 0 || cfg.nameLength > 200 ||
+        (cfg.level != PFS_LEVEL_ADAPTIVE && (cfg.level < PFS_LEVEL_STORE || cfg.level > PFS_LEVEL_BEST)))
+    {
+        bench_usage(argv[0]);
+        return 2;
+    }
+    
+    memset(&set, 0, sizeof(set));
+    
+    if (bench_generate(&cfg, &set) != PFS_OK)
+    {
+        fprintf(stderr, "out of memory generating %u files\n", cfg.fileCount);
+        bench_free(&set);
+        return 1;
+    }
+    
+    printf("# codec=%s files=%u mean_size=%u compressibility=%u name_length=%u level=%d seed=%u total_bytes=%lu\n",
+        pfs_codec_name(), cfg.fileCount, cfg.meanSize, cfg.compressibility, cfg.nameLength, cfg.level, cfg.seed,
+        (unsigned long)set.totalBytes);
+    printf("benchmark,iterations,ops,bytes,seconds,ns_per_op,mb_per_s\n");
+    
+    rc = bench_run(&cfg, &set);
+    bench_free(&set);
+    return rc;
+}
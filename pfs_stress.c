@@ -0,0 +1,567 @@
+/*
+** Concurrency check for PFS_OPEN_READ_ONLY handles. Writes a synthetic archive, then has several reader threads hammer
+** one read-only handle with whole-file reads, cached reads, enumeration and size queries, checking every payload
+** against the CRC recorded when it was generated. A single-threaded pass first checks that each read path counts the
+** bytes it inflates. Mutators must refuse with PFS_READ_ONLY. Exits non-zero on any
+** mismatch; build with -fsanitize=thread to have races reported as well. Deflate is always zlib's, so with
+** PFS_USE_LIBDEFLATE every pass is repeated under each inflate backend, round-tripping zlib output through libdeflate.
+*/
+
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 199309L
+#endif
+
+#include "pfs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <zlib.h>
+
+typedef struct {
+    uint32_t    fileCount;
+    uint32_t    meanSize;
+    uint32_t    threads;
+    uint32_t    rounds;
+    uint32_t    seed;
+    const char* path;
+} StressConfig;
+
+typedef struct {
+    char**      names;
+    uint8_t**   datas;
+    uint32_t*   lengths;
+    uint32_t*   crcs;
+    uint64_t    totalBytes;
+    uint32_t    count;
+} StressSet;
+
+typedef struct {
+    PFS*                pfs;
+    const StressSet*    set;
+    const StressConfig* cfg;
+    uint32_t            rng;
+    uint64_t            ops;
+    uint32_t            errors;
+} StressWorker;
+
+static uint32_t stress_rand(uint32_t* rng)
+{
+    /* xorshift32 */
+    uint32_t x = *rng;
+    
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *rng = x;
+    return x;
+}
+
+static uint32_t stress_crc(const uint8_t* data, uint32_t length)
+{
+    return (uint32_t)crc32(crc32(0L, Z_NULL, 0), data, length);
+}
+
+static int stress_generate(const StressConfig* cfg, StressSet* set)
+{
+    static const char* words[] = { "zone", "mesh", "bitmap", "sound", "actor", "spell" };
+    uint32_t rng = cfg->seed ? cfg->seed : 1;
+    uint32_t i, j;
+    
+    set->count = cfg->fileCount;
+    set->totalBytes = 0;
+    set->names = (char**)calloc(set->count, sizeof(char*));
+    set->datas = (uint8_t**)calloc(set->count, sizeof(uint8_t*));
+    set->lengths = (uint32_t*)calloc(set->count, sizeof(uint32_t));
+    set->crcs = (uint32_t*)calloc(set->count, sizeof(uint32_t));
+    
+    if (!set->names || !set->datas || !set->lengths || !set->crcs)
+        return PFS_OUT_OF_MEMORY;
+    
+    for (i = 0; i < set->count; i++)
+    {
+        /* Sizes up to twice the mean, with some large enough to span several blocks */
+        uint32_t length = 1 + stress_rand(&rng) % (cfg->meanSize * 2);
+        
+        if (i % 16 == 0)
+            length += 3 * 131072;
+        
+        set->names[i] = (char*)malloc(32);
+        set->datas[i] = (uint8_t*)malloc(length);
+        
+        if (!set->names[i] || !set->datas[i])
+            return PFS_OUT_OF_MEMORY;
+        
+        sprintf(set->names[i], "%u_stress.dat", i);
+        
+        for (j = 0; j < length; )
+        {
+            if (stress_rand(&rng) % 4)
+            {
+                const char* w = words[stress_rand(&rng) % (sizeof(words) / sizeof(words[0]))];
+                
+                while (*w && j < length)
+                {
+                    set->datas[i][j++] = (uint8_t)*w++;
+                }
+            }
+            else
+            {
+                set->datas[i][j++] = (uint8_t)stress_rand(&rng);
+            }
+        }
+        
+        set->lengths[i] = length;
+        set->crcs[i] = stress_crc(set->datas[i], length);
+        set->totalBytes += length;
+    }
+    
+    return PFS_OK;
+}
+
+static void stress_free(StressSet* set)
+{
+    uint32_t i;
+    
+    for (i = 0; i < set->count; i++)
+    {
+        if (set->names) free(set->names[i]);
+        if (set->datas) free(set->datas[i]);
+    }
+    
+    free(set->names);
+    free(set->datas);
+    free(set->lengths);
+    free(set->crcs);
+}
+
+/* Counts every failure but prints only the first few of each thread */
+static void stress_fail(StressWorker* w, const char* fmt, ...)
+{
+    va_list args;
+    
+    if (w->errors++ >= 10)
+        return;
+    
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+    fputc('\n', stderr);
+}
+
+static void stress_verify(StressWorker* w, const char* op, uint32_t index, int rc, const uint8_t* data, uint32_t length)
+{
+    const StressSet* set = w->set;
+    
+    if (rc != PFS_OK)
+        stress_fail(w, "%s %s: error %d", op, set->names[index], rc);
+    else if (length != set->lengths[index])
+        stress_fail(w, "%s %s: length %u, expected %u", op, set->names[index], length, set->lengths[index]);
+    else if (stress_crc(data, length) != set->crcs[index])
+        stress_fail(w, "%s %s: CRC mismatch", op, set->names[index]);
+}
+
+static void stress_enumerate(StressWorker* w)
+{
+    const StressSet* set = w->set;
+    uint32_t count = pfs_file_count(w->pfs);
+    uint32_t i;
+    
+    if (count != set->count)
+    {
+        stress_fail(w, "pfs_file_count: %u, expected %u", count, set->count);
+        return;
+    }
+    
+    for (i = 0; i < count; i++)
+    {
+        const char* name = pfs_file_name(w->pfs, i);
+        uint32_t index;
+        
+        if (!name)
+        {
+            stress_fail(w, "pfs_file_name(%u): NULL", i);
+            continue;
+        }
+        
+        /* Generated names start with their index in the set */
+        index = (uint32_t)strtoul(name, NULL, 10);
+        
+        if (index >= set->count || strcmp(name, set->names[index]) != 0)
+            stress_fail(w, "pfs_file_name(%u): unexpected %s", i, name);
+        else if (pfs_file_size(w->pfs, i) != set->lengths[index])
+            stress_fail(w, "pfs_file_size(%u): %u, expected %u", i, pfs_file_size(w->pfs, i), set->lengths[index]);
+    }
+}
+
+static void stress_mutators(StressWorker* w)
+{
+    const char* name = w->set->names[0];
+    const char* names[1];
+    const void* datas[1];
+    uint32_t lengths[1];
+    int rc;
+    
+    names[0] = "stress_new.dat";
+    datas[0] = "payload";
+    lengths[0] = 7;
+    
+    if ((rc = pfs_insert_file(w->pfs, names[0], datas[0], lengths[0])) != PFS_READ_ONLY)
+        stress_fail(w, "pfs_insert_file: %d, expected PFS_READ_ONLY", rc);
+    if ((rc = pfs_insert_file_ex(w->pfs, name, datas[0], lengths[0], PFS_LEVEL_DEFAULT, 0)) != PFS_READ_ONLY)
+        stress_fail(w, "pfs_insert_file_ex: %d, expected PFS_READ_ONLY", rc);
+    if ((rc = pfs_insert_files(w->pfs, names, datas, lengths, 1, 1)) != PFS_READ_ONLY)
+        stress_fail(w, "pfs_insert_files: %d, expected PFS_READ_ONLY", rc);
+    if ((rc = pfs_insert_compressed(w->pfs, names[0], datas[0], lengths[0])) != PFS_READ_ONLY)
+        stress_fail(w, "pfs_insert_compressed: %d, expected PFS_READ_ONLY", rc);
+    if ((rc = pfs_fast_file_duplicate(w->pfs, w->pfs, name)) != PFS_READ_ONLY)
+        stress_fail(w, "pfs_fast_file_duplicate: %d, expected PFS_READ_ONLY", rc);
+    if ((rc = pfs_remove_file(w->pfs, name)) != PFS_READ_ONLY)
+        stress_fail(w, "pfs_remove_file: %d, expected PFS_READ_ONLY", rc);
+    if ((rc = pfs_save_incremental(w->pfs, w->cfg->path)) != PFS_READ_ONLY)
+        stress_fail(w, "pfs_save_incremental: %d, expected PFS_READ_ONLY", rc);
+    if ((rc = pfs_compact(w->pfs, w->cfg->path, 0)) != PFS_READ_ONLY)
+        stress_fail(w, "pfs_compact: %d, expected PFS_READ_ONLY", rc);
+}
+
+static void* stress_thread(void* arg)
+{
+    StressWorker* w = (StressWorker*)arg;
+    const StressSet* set = w->set;
+    uint32_t round, i;
+    
+    for (round = 0; round < w->cfg->rounds; round++)
+    {
+        stress_enumerate(w);
+        stress_mutators(w);
+        
+        for (i = 0; i < set->count; i++)
+        {
+            uint32_t index = stress_rand(&w->rng) % set->count;
+            const char* name = set->names[index];
+            uint32_t length = 0;
+            uint8_t* data = NULL;
+            const uint8_t* shared = NULL;
+            int rc;
+            
+            switch (stress_rand(&w->rng) % 4)
+            {
+            case 0:
+                rc = pfs_file_data(w->pfs, name, &data, &length);
+                stress_verify(w, "pfs_file_data", index, rc, data, length);
+                pfs_file_data_free(data);
+                break;
+            case 1:
+                data = (uint8_t*)malloc(set->lengths[index]);
+                
+                if (!data)
+                {
+                    stress_fail(w, "out of memory");
+                    break;
+                }
+                
+                rc = pfs_file_data_into(w->pfs, name, data, set->lengths[index], &length);
+                stress_verify(w, "pfs_file_data_into", index, rc, data, length);
+                free(data);
+                break;
+            case 2:
+                rc = pfs_file_data_shared(w->pfs, name, &shared, &length);
+                stress_verify(w, "pfs_file_data_shared", index, rc, shared, length);
+                
+                if (rc == PFS_OK)
+                    pfs_file_data_release(shared);
+                break;
+            default:
+                length = pfs_file_size_by_name(w->pfs, name);
+                
+                if (length != set->lengths[index])
+                    stress_fail(w, "pfs_file_size_by_name %s: %u, expected %u", name, length, set->lengths[index]);
+                break;
+            }
+            
+            w->ops++;
+        }
+    }
+    
+    return NULL;
+}
+
+static int stress_write(const StressConfig* cfg, const StressSet* set)
+{
+    PFS* pfs = NULL;
+    uint32_t i;
+    int rc;
+    
+    rc = pfs_create_new(&pfs);
+    if (rc) goto fail;
+    
+    for (i = 0; i < set->count; i++)
+    {
+        rc = pfs_insert_file(pfs, set->names[i], set->datas[i], set->lengths[i]);
+        if (rc) goto fail;
+    }
+    
+    rc = pfs_write_to_disk(pfs, cfg->path);
+    
+fail:
+    if (pfs) pfs_close(pfs);
+    return rc;
+}
+
+/* After a read that inflates the whole entry, the handle must have counted exactly its size */
+static void stress_check_inflated(StressWorker* w, const char* op, uint32_t index)
+{
+    PfsStats stats;
+    
+    pfs_get_stats(w->pfs, &stats);
+    
+    /* PFS_NO_STATS builds count nothing */
+    if (stats.blocksInflated == 0)
+        return;
+    
+    if (stats.bytesInflated != w->set->lengths[index])
+        stress_fail(w, "%s %s: bytesInflated %lu, expected %u", op, w->set->names[index],
+            (unsigned long)stats.bytesInflated, w->set->lengths[index]);
+}
+
+/* Single-threaded: every read path must count the bytes a multi-block entry inflates to, and only those */
+static uint32_t stress_stats(const StressConfig* cfg, const StressSet* set, const char* label)
+{
+    StressWorker w;
+    PfsStream* stream;
+    uint8_t* data = NULL;
+    uint32_t length = 0;
+    uint32_t index = 0;     /* Every 16th entry spans several blocks */
+    const char* name = set->names[index];
+    int rc;
+    
+    memset(&w, 0, sizeof(w));
+    w.set = set;
+    w.cfg = cfg;
+    
+    rc = pfs_open(&w.pfs, cfg->path);
+    
+    if (rc)
+    {
+        fprintf(stderr, "%s: pfs_open failed: %d\n", label, rc);
+        return 1;
+    }
+    
+    pfs_reset_stats(w.pfs);
+    rc = pfs_file_data(w.pfs, name, &data, &length);
+    stress_verify(&w, "pfs_file_data", index, rc, data, length);
+    stress_check_inflated(&w, "pfs_file_data", index);
+    pfs_file_data_free(data);
+    data = NULL;
+    
+    pfs_reset_stats(w.pfs);
+    rc = pfs_file_data_parallel(w.pfs, name, &data, &length, 2);
+    stress_verify(&w, "pfs_file_data_parallel", index, rc, data, length);
+    stress_check_inflated(&w, "pfs_file_data_parallel", index);
+    pfs_file_data_free(data);
+    data = NULL;
+    
+    data = (uint8_t*)malloc(set->lengths[index]);
+    
+    if (data)
+    {
+        pfs_reset_stats(w.pfs);
+        rc = pfs_file_data_into(w.pfs, name, data, set->lengths[index], &length);
+        stress_verify(&w, "pfs_file_data_into", index, rc, data, length);
+        stress_check_inflated(&w, "pfs_file_data_into", index);
+        
+        pfs_reset_stats(w.pfs);
+        rc = pfs_stream_open(&stream, w.pfs, name);
+        
+        if (rc == PFS_OK)
+        {
+            rc = pfs_stream_read(stream, data, set->lengths[index], &length);
+            pfs_stream_close(stream);
+        }
+        
+        stress_verify(&w, "pfs_stream_read", index, rc, data, length);
+        stress_check_inflated(&w, "pfs_stream_read", index);
+        free(data);
+    }
+    
+    printf("%s: errors=%u\n", label, w.errors);
+    pfs_close(w.pfs);
+    return w.errors;
+}
+
+/* One pass over a fresh read-only handle; returns the number of errors the threads saw */
+static uint32_t stress_run(const StressConfig* cfg, const StressSet* set, const char* label, int flags)
+{
+    StressWorker* workers = NULL;
+    pthread_t* threads = NULL;
+    PfsCacheStats cache;
+    PFS* pfs = NULL;
+    uint64_t ops = 0;
+    uint32_t errors = 0;
+    uint32_t started = 0;
+    uint32_t i;
+    int rc;
+    
+    rc = pfs_open_ex(&pfs, cfg->path, flags);
+    
+    if (rc)
+    {
+        fprintf(stderr, "%s: pfs_open_ex failed: %d\n", label, rc);
+        return 1;
+    }
+    
+    /* Half the set, so cached readers both hit and evict each other */
+    pfs_set_cache_budget(pfs, (uint32_t)(set->totalBytes / 2));
+    
+    workers = (StressWorker*)calloc(cfg->threads, sizeof(StressWorker));
+    threads = (pthread_t*)calloc(cfg->threads, sizeof(pthread_t));
+    
+    if (!workers || !threads)
+    {
+        fprintf(stderr, "%s: out of memory\n", label);
+        errors = 1;
+        goto done;
+    }
+    
+    for (i = 0; i < cfg->threads; i++)
+    {
+        workers[i].pfs = pfs;
+        workers[i].set = set;
+        workers[i].cfg = cfg;
+        workers[i].rng = (cfg->seed ? cfg->seed : 1) * 2654435761u + i + 1;
+        
+        if (pthread_create(&threads[i], NULL, stress_thread, &workers[i]) != 0)
+        {
+            fprintf(stderr, "%s: pthread_create failed\n", label);
+            errors++;
+            break;
+        }
+        
+        started++;
+    }
+    
+    for (i = 0; i < started; i++)
+    {
+        pthread_join(threads[i], NULL);
+        ops += workers[i].ops;
+        errors += workers[i].errors;
+    }
+    
+    pfs_cache_stats(pfs, &cache);
+    printf("%s: threads=%u ops=%lu errors=%u cache_hits=%lu cache_evictions=%lu\n", label, started,
+        (unsigned long)ops, errors, (unsigned long)cache.hits, (unsigned long)cache.evictions);
+    
+done:
+    free(workers);
+    free(threads);
+    pfs_close(pfs);
+    return errors;
+}
+
+static void stress_usage(const char* argv0)
+{
+    fprintf(stderr,
+        "usage: %s [options]\n"
+        "  -n count     files in the archive (default 300)\n"
+        "  -s bytes     mean file size (default 8192)\n"
+        "  -t count     reader threads (default 8)\n"
+        "  -r count     rounds per thread (default 4)\n"
+        "  -S seed      generator seed (default 1)\n"
+        "  -o path      scratch archive (default pfs_stress.s3d)\n",
+        argv0);
+}
+
+int main(int argc, char** argv)
+{
+    static const char* codecs[] = { "zlib", "libdeflate" };
+    StressConfig cfg;
+    StressSet set;
+    uint32_t errors = 0;
+    int i, rc;
+    
+    cfg.fileCount = 300;
+    cfg.meanSize = 8192;
+    cfg.threads = 8;
+    cfg.rounds = 4;
+    cfg.seed = 1;
+    cfg.path = "pfs_stress.s3d";
+    
+    for (i = 1; i < argc; i++)
+    {
+        const char* arg = argv[i];
+        const char* value = (i + 1 < argc) ? argv[i + 1] : NULL;
+        
+        if (arg[0] != '-' || arg[1] == 0 || arg[2] != 0 || !value)
+        {
+            stress_usage(argv[0]);
+            return 2;
+        }
+        
+        switch (arg[1])
+        {
+        case 'n': cfg.fileCount = (uint32_t)strtoul(value, NULL, 10); break;
+        case 's': cfg.meanSize = (uint32_t)strtoul(value, NULL, 10); break;
+        case 't': cfg.threads = (uint32_t)strtoul(value, NULL, 10); break;
+        case 'r': cfg.rounds = (uint32_t)strtoul(value, NULL, 10); break;
+        case 'S': cfg.seed = (uint32_t)strtoul(value, NULL, 10); break;
+        case 'o': cfg.path = value; break;
+        default:
+            stress_usage(argv[0]);
+            return 2;
+        }
+        
+        i++;
+    }
+    
+    if (cfg.fileCount == 0 || cfg.meanSize == 0 || cfg.threads == 0)
+    {
+        stress_usage(argv[0]);
+        return 2;
+    }
+    
+    memset(&set, 0, sizeof(set));
+    
+    if (stress_generate(&cfg, &set) != PFS_OK)
+    {
+        fprintf(stderr, "out of memory generating %u files\n", cfg.fileCount);
+        stress_free(&set);
+        return 1;
+    }
+    
+    rc = stress_write(&cfg, &set);
+    
+    if (rc)
+    {
+        fprintf(stderr, "writing %s failed: %d\n", cfg.path, rc);
+        stress_free(&set);
+        return 1;
+    }
+    
+    printf("# files=%u total_bytes=%lu\n", set.count, (unsigned long)set.totalBytes);
+    
+    for (i = 0; i < (int)(sizeof(codecs) / sizeof(codecs[0])); i++)
+    {
+        char label[64];
+        
+        /* Backends not built in are skipped */
+        if (pfs_set_codec(codecs[i]) != PFS_OK)
+            continue;
+        
+        sprintf(label, "%s_stats", codecs[i]);
+        errors += stress_stats(&cfg, &set, label);
+        sprintf(label, "%s_read_only", codecs[i]);
+        errors += stress_run(&cfg, &set, label, PFS_OPEN_READ_ONLY);
+        sprintf(label, "%s_read_only_mmap", codecs[i]);
+        errors += stress_run(&cfg, &set, label, PFS_OPEN_READ_ONLY | PFS_OPEN_MMAP);
+        sprintf(label, "%s_read_only_directory", codecs[i]);
+        errors += stress_run(&cfg, &set, label, PFS_OPEN_READ_ONLY | PFS_OPEN_DIRECTORY_ONLY);
+    }
+    
+    pfs_set_codec(NULL);
+    remove(cfg.path);
+    stress_free(&set);
+    
+    printf("%s\n", errors ? "FAILED" : "OK");
+    return errors ? 1 : 0;
+}